@@ -0,0 +1,158 @@
+/*
+ * Connection to a Redis server shared by the benchmark tools: commands are
+ * written as is and replies are parsed just enough to be counted.
+ */
+
+#ifndef BENCH_CONN_H
+#define BENCH_CONN_H
+
+#include <errno.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#define BENCH_BUFSIZE (64 * 1024)
+
+typedef struct bench_conn {
+  int fd;
+  char buf[BENCH_BUFSIZE];
+  size_t start, end;
+} bench_conn;
+
+static long long nanos() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (long long) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void die(const char *msg) {
+  if (errno != 0) {
+    perror(msg);
+  } else {
+    fprintf(stderr, "%s\n", msg);
+  }
+  exit(1);
+}
+
+static void bench_connect(bench_conn *conn, const char *host,
+                          const char *port) {
+  struct addrinfo hints = {.ai_family = AF_UNSPEC,
+                           .ai_socktype = SOCK_STREAM};
+  struct addrinfo *res;
+  if (getaddrinfo(host, port, &hints, &res) != 0) {
+    die("cannot resolve host");
+  }
+  conn->fd = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+  if (conn->fd < 0 || connect(conn->fd, res->ai_addr, res->ai_addrlen) < 0) {
+    die("cannot connect");
+  }
+  freeaddrinfo(res);
+
+  int one = 1;
+  setsockopt(conn->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  conn->start = conn->end = 0;
+}
+
+static void bench_write(bench_conn *conn, const char *buf, size_t len) {
+  while (len > 0) {
+    ssize_t n = write(conn->fd, buf, len);
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      die("write");
+    }
+    buf += n;
+    len -= n;
+  }
+}
+
+/* bench_fill reads more of the replies, moving what is left to the front. */
+static void bench_fill(bench_conn *conn) {
+  if (conn->start > 0) {
+    memmove(conn->buf, conn->buf + conn->start, conn->end - conn->start);
+    conn->end -= conn->start;
+    conn->start = 0;
+  }
+  if (conn->end == BENCH_BUFSIZE) {
+    die("reply too long");
+  }
+  for (;;) {
+    ssize_t n = read(conn->fd, conn->buf + conn->end, BENCH_BUFSIZE - conn->end);
+    if (n < 0 && errno == EINTR) continue;
+    if (n == 0) errno = 0;
+    if (n <= 0) die("connection closed");
+    conn->end += n;
+    return;
+  }
+}
+
+/* bench_line returns the next CRLF terminated line, without the CRLF. */
+static char *bench_line(bench_conn *conn) {
+  for (;;) {
+    char *line = conn->buf + conn->start;
+    char *cr = memchr(line, '\r', conn->end - conn->start);
+    if (cr != NULL && cr + 1 < conn->buf + conn->end) {
+      *cr = '\0';
+      conn->start = cr + 2 - conn->buf;
+      return line;
+    }
+    bench_fill(conn);
+  }
+}
+
+/* bench_reply consumes one reply and returns its first integer, if any. The
+ * first integer of a RATER.LIMIT reply is whether the call was limited, and
+ * so is the first byte of a blob, plus one. Bytes are counted into bytes. */
+static long long bench_reply(bench_conn *conn, long long *bytes) {
+  char *line = bench_line(conn);
+  long long value = 0;
+  *bytes += strlen(line) + 2;
+
+  switch (line[0]) {
+  case ':':
+    return strtoll(line + 1, NULL, 10);
+  case '*': {
+    long long len = strtoll(line + 1, NULL, 10);
+    for (long long i = 0; i < len; i++) {
+      long long item = bench_reply(conn, bytes);
+      if (i == 0) value = item;
+    }
+    return value;
+  }
+  case '$': {
+    long long len = strtoll(line + 1, NULL, 10);
+    while (len >= 0 && conn->end - conn->start < (size_t) len + 2) {
+      bench_fill(conn);
+    }
+    if (len < 0) return 0;
+    value = len > 0 ? (unsigned char) conn->buf[conn->start] - 1 : 0;
+    conn->start += len + 2;
+    *bytes += len + 2;
+    return value;
+  }
+  case '%': {
+    long long len = strtoll(line + 1, NULL, 10);
+    for (long long i = 0; i < len * 2; i++) {
+      long long item = bench_reply(conn, bytes);
+      if (i == 1) value = item;
+    }
+    return value;
+  }
+  case '+':
+    return 0;
+  case '-':
+    fprintf(stderr, "error reply: %s\n", line + 1);
+    exit(1);
+  default:
+    errno = 0;
+    die("protocol error");
+  }
+  return 0;
+}
+
+#endif /* BENCH_CONN_H */
@@ -0,0 +1,159 @@
+/*
+ * Throughput and latency benchmark of RATER.LIMIT against a running Redis.
+ *
+ * Requests are sent over a single connection, in pipelines of the given
+ * depth. Each request picks a key uniformly out of the given cardinality and
+ * goes either to a "tight" limit, which allows a single call per hour and so
+ * is limited from then on, or to an "open" one that is never limited, which
+ * drives the share of limited replies. Latency is the round trip of the
+ * pipeline a request was part of, as seen by a client. Replies may be given
+ * any shape of the REPLY option, to compare the bytes they take.
+ *
+ * Usually run through `make bench`, which starts a throwaway redis-server with
+ * the module loaded. See `./bench/bench_server -?` for the options.
+ */
+
+#include <strings.h>
+
+#include "bench_conn.h"
+
+#define BENCH_MAXCMD 256
+
+static int bench_append(char *buf, const char *key, long long id, int tight,
+                        long long quantity, const char *reply) {
+  char keyname[64];
+  char quantity_str[24];
+  int keylen = snprintf(keyname, sizeof(keyname), "%s:%s:%lld", key,
+                        tight ? "tight" : "open", id);
+  int qlen = snprintf(quantity_str, sizeof(quantity_str), "%lld", quantity);
+  const char *burst = tight ? "0" : "1000000000";
+  const char *count = tight ? "1" : "1000000000";
+  const char *period = tight ? "3600" : "1";
+
+  int len = sprintf(buf,
+                    "*%d\r\n$11\r\nRATER.LIMIT\r\n$%d\r\n%s\r\n$%zu\r\n%s\r\n"
+                    "$%zu\r\n%s\r\n$%zu\r\n%s\r\n$%d\r\n%s\r\n",
+                    reply ? 8 : 6, keylen, keyname, strlen(burst), burst,
+                    strlen(count), count, strlen(period), period, qlen,
+                    quantity_str);
+  if (reply) {
+    len += sprintf(buf + len, "$5\r\nREPLY\r\n$%zu\r\n%s\r\n", strlen(reply),
+                   reply);
+  }
+  return len;
+}
+
+static int compare_ll(const void *a, const void *b) {
+  long long x = *(const long long *) a, y = *(const long long *) b;
+  return x < y ? -1 : x > y;
+}
+
+static double percentile(const long long *sorted, long long len, double p) {
+  long long i = (long long) (p * (len - 1));
+  return sorted[i] / 1000.0;
+}
+
+static void usage(const char *name) {
+  fprintf(stderr,
+          "usage: %s [options]\n"
+          "  -h <host>      server host (127.0.0.1)\n"
+          "  -p <port>      server port (6379)\n"
+          "  -n <requests>  total number of requests (1000000)\n"
+          "  -k <keys>      key cardinality (10000)\n"
+          "  -P <depth>     pipeline depth (1)\n"
+          "  -l <ratio>     share of requests that are limited (0.1)\n"
+          "  -q <n>[-<m>]   quantity, fixed or uniform in [n, m] (1)\n"
+          "  -x <prefix>    key prefix (rater:bench)\n"
+          "  -R <shape>     REPLY option, array unless given\n"
+          "  -s <seed>      random seed (1)\n",
+          name);
+  exit(1);
+}
+
+int main(int argc, char **argv) {
+  const char *host = "127.0.0.1", *port = "6379", *prefix = "rater:bench";
+  const char *reply = NULL;
+  long long requests = 1000000, keys = 10000, depth = 1;
+  long long min_quantity = 1, max_quantity = 1;
+  double limited_ratio = 0.1;
+  unsigned int seed = 1;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "h:p:n:k:P:l:q:x:s:R:")) != -1) {
+    switch (opt) {
+    case 'h': host = optarg; break;
+    case 'p': port = optarg; break;
+    case 'n': requests = atoll(optarg); break;
+    case 'k': keys = atoll(optarg); break;
+    case 'P': depth = atoll(optarg); break;
+    case 'l': limited_ratio = atof(optarg); break;
+    case 'q': {
+      char *end;
+      min_quantity = max_quantity = strtoll(optarg, &end, 10);
+      if (*end == '-') max_quantity = strtoll(end + 1, NULL, 10);
+      break;
+    }
+    case 'x': prefix = optarg; break;
+    case 's': seed = atoi(optarg); break;
+    case 'R': reply = optarg; break;
+    default: usage(argv[0]);
+    }
+  }
+  if (requests <= 0 || keys <= 0 || depth <= 0 || limited_ratio < 0 ||
+      limited_ratio > 1 || min_quantity < 1 || max_quantity < min_quantity ||
+      strlen(prefix) > 32 || (reply && strlen(reply) > 16)) {
+    usage(argv[0]);
+  }
+
+  bench_conn *conn = malloc(sizeof(bench_conn));
+  bench_connect(conn, host, port);
+  srand(seed);
+
+  long long batches = (requests + depth - 1) / depth;
+  long long *latencies = malloc(batches * sizeof(long long));
+  char *buf = malloc(depth * BENCH_MAXCMD);
+  long long limited = 0, sent = 0, bytes = 0;
+  int retry = reply && strcasecmp(reply, "retry") == 0;
+
+  long long start = nanos();
+  for (long long batch = 0; batch < batches; batch++) {
+    long long count = requests - sent < depth ? requests - sent : depth;
+    size_t len = 0;
+    for (long long i = 0; i < count; i++) {
+      long long id = rand() % keys;
+      int tight = rand() < limited_ratio * ((double) RAND_MAX + 1);
+      long long quantity =
+          min_quantity + rand() % (max_quantity - min_quantity + 1);
+      len += bench_append(buf + len, prefix, id, tight, quantity, reply);
+    }
+
+    long long batch_start = nanos();
+    bench_write(conn, buf, len);
+    for (long long i = 0; i < count; i++) {
+      /* Retry replies are -1 unless limited */
+      long long value = bench_reply(conn, &bytes);
+      limited += retry ? value >= 0 : value;
+    }
+    latencies[batch] = nanos() - batch_start;
+    sent += count;
+  }
+  long long elapsed = nanos() - start;
+
+  qsort(latencies, batches, sizeof(long long), compare_ll);
+  printf("requests %lld keys %lld pipeline %lld quantity %lld-%lld\n", requests,
+         keys, depth, min_quantity, max_quantity);
+  printf("%.0f ops/s, %.2f%% limited, %.1f reply bytes/op\n",
+         requests * 1e9 / elapsed, 100.0 * limited / requests,
+         (double) bytes / requests);
+  printf("latency usec p50 %.1f p99 %.1f p999 %.1f max %.1f\n",
+         percentile(latencies, batches, 0.5),
+         percentile(latencies, batches, 0.99),
+         percentile(latencies, batches, 0.999),
+         latencies[batches - 1] / 1000.0);
+
+  free(buf);
+  free(latencies);
+  close(conn->fd);
+  free(conn);
+  return 0;
+}
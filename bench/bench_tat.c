@@ -0,0 +1,84 @@
+/*
+ * Microbenchmark of how RATER.LIMIT reads and writes the theoretical arrival
+ * time of string keys.
+ *
+ * The "copy" path is what the module used to do: copy the string of the key
+ * into a fresh RedisModuleString to parse it, then format the new value into
+ * another one to store it. Those strings are emulated here with malloc, which
+ * is what RedisModule_CreateString and friends boil down to. The "direct" path
+ * is the one used now, parsing from and formatting into the key buffer.
+ *
+ * Build and run with `make bench_tat && ./bench/bench_tat [iterations]`.
+ */
+
+#include <stdio.h>
+
+#include "../ratelimit.c"
+
+static long long allocations = 0;
+
+static void *counting_alloc(size_t bytes) {
+  allocations++;
+  return malloc(bytes);
+}
+
+/* copy_get_tat emulates RedisModule_CreateString + StringToLongLong. */
+static int copy_get_tat(const char *buf, size_t len, long long *tat) {
+  char *copy = counting_alloc(len + 1);
+  memcpy(copy, buf, len);
+  copy[len] = '\0';
+  char *end;
+  *tat = strtoll(copy, &end, 10);
+  int ret = *end == '\0' ? 0 : -1;
+  free(copy);
+  return ret;
+}
+
+/* copy_set_tat emulates RedisModule_CreateStringFromLongLong + StringSet. */
+static size_t copy_set_tat(char *buf, long long tat) {
+  char *str = counting_alloc(RATER_TAT_MAXLEN + 1);
+  int len = snprintf(str, RATER_TAT_MAXLEN + 1, "%lld", tat);
+  memcpy(buf, str, len);
+  free(str);
+  return len;
+}
+
+static size_t direct_set_tat(char *buf, long long tat) {
+  return rater_format_tat(buf, tat);
+}
+
+typedef int (*get_func)(const char *, size_t, long long *);
+typedef size_t (*set_func)(char *, long long);
+
+static void run(const char *name, get_func get, set_func set,
+                long long iterations) {
+  char key[RATER_TAT_MAXLEN];
+  size_t len = rater_format_tat(key, get_nanos());
+  long long sink = 0;
+
+  allocations = 0;
+  long long start = get_nanos();
+  for (long long i = 0; i < iterations; i++) {
+    long long tat;
+    if (get(key, len, &tat) != 0) abort();
+    sink += tat;
+    len = set(key, tat + 1000);
+  }
+  long long elapsed = get_nanos() - start;
+
+  printf("%-8s %8.2f ns/call %6.2f allocations/call (%lld)\n", name,
+         (double) elapsed / iterations, (double) allocations / iterations,
+         sink & 1);
+}
+
+int main(int argc, char **argv) {
+  long long iterations = argc > 1 ? atoll(argv[1]) : 10000000;
+  if (iterations <= 0) {
+    fprintf(stderr, "usage: %s [iterations]\n", argv[0]);
+    return 1;
+  }
+
+  run("copy", copy_get_tat, copy_set_tat, iterations);
+  run("direct", rater_parse_tat, direct_set_tat, iterations);
+  return 0;
+}
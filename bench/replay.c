@@ -0,0 +1,194 @@
+/*
+ * Replays a trace of RATER.LIMIT calls against a running Redis, as fast as it
+ * takes them, and reports the throughput along with the decisions that differ
+ * from those recorded in the trace.
+ *
+ * Every line of a trace is a call, as the nanosecond time it was made at
+ * followed by the arguments of RATER.LIMIT and optionally by whether it was
+ * limited, 0 or 1:
+ *
+ *   1700000000000000000 user123 15 30 60 1 0
+ *
+ * Empty lines and lines starting with # are skipped. Calls are sent with their
+ * time as NOW, which the module only accepts when loaded with "ALLOW-NOW yes",
+ * so decisions don't depend on how fast the trace is replayed. Keys are
+ * prefixed, by default with the time of the run, for every run to start from
+ * no state. With -o the trace is written back with the decisions of the run,
+ * which makes for the reference of the next ones:
+ *
+ *   BENCH_TOOL=replay BENCH_MODULE_ARGS="ALLOW-NOW yes" \
+ *     ./bench/run.sh -f trace.txt -o reference.txt
+ *
+ * See `./bench/replay -?` for the options.
+ */
+
+#include "bench_conn.h"
+
+#define REPLAY_MAXLINE 1024
+#define REPLAY_MAXCMD (REPLAY_MAXLINE + 256)
+#define REPLAY_MAXDIFFS 10
+
+typedef struct replay_call {
+  char line[REPLAY_MAXLINE];
+  /* Recorded decision, or -1 */
+  int expected;
+} replay_call;
+
+/* replay_format writes the command of argc arguments as RESP into buf, which
+ * must be large enough, and returns its length. */
+static size_t replay_format(char *buf, int argc, const char **argv) {
+  size_t len = sprintf(buf, "*%d\r\n", argc);
+  for (int i = 0; i < argc; i++) {
+    len += sprintf(buf + len, "$%zu\r\n%s\r\n", strlen(argv[i]), argv[i]);
+  }
+  return len;
+}
+
+/* replay_parse appends the command of the trace line to buf, returning its
+ * length, 0 to skip the line or -1 if it is invalid. */
+static int replay_parse(char *buf, replay_call *call, const char *prefix) {
+  char copy[REPLAY_MAXLINE];
+  const char *fields[8];
+  int count = 0;
+
+  strcpy(copy, call->line);
+  for (char *t = strtok(copy, " \t\r\n"); t; t = strtok(NULL, " \t\r\n")) {
+    if (count == 8) return -1;
+    fields[count++] = t;
+  }
+  if (count == 0 || fields[0][0] == '#') return 0;
+  if (count < 6 || count > 7) return -1;
+  call->expected = count == 7 ? atoi(fields[6]) : -1;
+
+  char keyname[REPLAY_MAXLINE + 64];
+  snprintf(keyname, sizeof(keyname), "%s%s", prefix, fields[1]);
+  const char *argv[] = {"RATER.LIMIT", keyname,   fields[2], fields[3],
+                        fields[4],     fields[5], "NOW",     fields[0],
+                        "REPLY",       "limited"};
+  return replay_format(buf, 10, argv);
+}
+
+static void usage(const char *name) {
+  fprintf(stderr,
+          "usage: %s -f <trace> [options]\n"
+          "  -h <host>      server host (127.0.0.1)\n"
+          "  -p <port>      server port (6379)\n"
+          "  -f <trace>     trace to replay, - for stdin\n"
+          "  -o <file>      write the trace back with the decisions of the run\n"
+          "  -P <depth>     pipeline depth (16)\n"
+          "  -x <prefix>    key prefix (replay:<time>:)\n",
+          name);
+  exit(1);
+}
+
+int main(int argc, char **argv) {
+  const char *host = "127.0.0.1", *port = "6379", *trace = NULL,
+             *output = NULL;
+  char prefix[64];
+  long long depth = 16;
+
+  snprintf(prefix, sizeof(prefix), "replay:%lld:", (long long) time(NULL));
+  int opt;
+  while ((opt = getopt(argc, argv, "h:p:f:o:P:x:")) != -1) {
+    switch (opt) {
+    case 'h': host = optarg; break;
+    case 'p': port = optarg; break;
+    case 'f': trace = optarg; break;
+    case 'o': output = optarg; break;
+    case 'P': depth = atoll(optarg); break;
+    case 'x': snprintf(prefix, sizeof(prefix), "%s", optarg); break;
+    default: usage(argv[0]);
+    }
+  }
+  if (trace == NULL || depth <= 0) {
+    usage(argv[0]);
+  }
+
+  FILE *in = strcmp(trace, "-") == 0 ? stdin : fopen(trace, "r");
+  if (in == NULL) die(trace);
+  FILE *out = output ? fopen(output, "w") : NULL;
+  if (output && out == NULL) die(output);
+
+  bench_conn *conn = malloc(sizeof(bench_conn));
+  bench_connect(conn, host, port);
+
+  replay_call *calls = malloc(depth * sizeof(replay_call));
+  char *buf = malloc(depth * REPLAY_MAXCMD);
+  long long lineno = 0, total = 0, limited = 0, compared = 0, diffs = 0;
+  long long bytes = 0;
+  int eof = 0;
+
+  long long start = nanos();
+  while (!eof) {
+    long long count = 0;
+    size_t len = 0;
+    while (count < depth) {
+      replay_call *call = &calls[count];
+      if (fgets(call->line, sizeof(call->line), in) == NULL) {
+        eof = 1;
+        break;
+      }
+      lineno++;
+      int n = replay_parse(buf + len, call, prefix);
+      if (n < 0) {
+        fprintf(stderr, "line %lld: invalid call\n", lineno);
+        exit(1);
+      }
+      if (n == 0) continue;
+      len += n;
+      count++;
+    }
+    if (count == 0) break;
+
+    bench_write(conn, buf, len);
+    for (long long i = 0; i < count; i++) {
+      replay_call *call = &calls[i];
+      long long decision = bench_reply(conn, &bytes);
+      limited += decision;
+      if (call->expected >= 0) {
+        compared++;
+        if (call->expected != decision && diffs++ < REPLAY_MAXDIFFS) {
+          fprintf(stderr, "expected %d, got %lld: %s", call->expected,
+                  decision, call->line);
+        }
+      }
+      if (out) {
+        /* The recorded decision, if any, is replaced */
+        char *line = call->line;
+        size_t line_len = strcspn(line, "\r\n");
+        line[line_len] = '\0';
+        if (call->expected >= 0) {
+          while (line_len > 0 && line[line_len - 1] != ' ' &&
+                 line[line_len - 1] != '\t') {
+            line_len--;
+          }
+          while (line_len > 0 &&
+                 (line[line_len - 1] == ' ' || line[line_len - 1] == '\t')) {
+            line_len--;
+          }
+          line[line_len] = '\0';
+        }
+        fprintf(out, "%s %lld\n", line, decision);
+      }
+    }
+    total += count;
+  }
+  long long elapsed = nanos() - start;
+
+  if (total == 0) {
+    fprintf(stderr, "no calls in %s\n", trace);
+    return 1;
+  }
+  printf("calls %lld pipeline %lld\n", total, depth);
+  printf("%.0f ops/s, %.2f%% limited\n", total * 1e9 / elapsed,
+         100.0 * limited / total);
+  printf("%lld of %lld recorded decisions differ\n", diffs, compared);
+
+  if (out) fclose(out);
+  if (in != stdin) fclose(in);
+  free(buf);
+  free(calls);
+  close(conn->fd);
+  free(conn);
+  return diffs > 0 ? 2 : 0;
+}
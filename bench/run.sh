@@ -0,0 +1,37 @@
+#!/bin/sh
+#
+# Start a throwaway redis-server with the module loaded, run bench_server
+# against it with the given options and stop the server again.
+#
+#   REDIS_SERVER=/path/to/redis-server ./bench/run.sh -n 1000000 -P 16
+#
+# BENCH_TOOL runs another tool of bench/ instead, such as replay.
+#
+# BENCH_PORT picks the port (6399) and BENCH_MODULE_ARGS are passed to the
+# module when it is loaded, e.g. BENCH_MODULE_ARGS="STORAGE native".
+
+set -e
+
+cd "$(dirname "$0")/.."
+
+REDIS_SERVER=${REDIS_SERVER:-redis-server}
+BENCH_PORT=${BENCH_PORT:-6399}
+
+$REDIS_SERVER --port "$BENCH_PORT" --save "" --appendonly no \
+  --daemonize no --loglevel warning \
+  --loadmodule "$(pwd)/ratelimit.so" $BENCH_MODULE_ARGS &
+server=$!
+trap 'kill $server 2>/dev/null; wait $server 2>/dev/null' EXIT INT TERM
+
+# Wait until the server accepts connections
+i=0
+while ! ./bench/bench_server -p "$BENCH_PORT" -n 1 >/dev/null 2>&1; do
+  i=$((i + 1))
+  if [ $i -ge 50 ] || ! kill -0 $server 2>/dev/null; then
+    echo "redis-server did not start" >&2
+    exit 1
+  fi
+  sleep 0.1
+done
+
+./bench/${BENCH_TOOL:-bench_server} -p "$BENCH_PORT" "$@"
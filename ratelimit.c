@@ -20,230 +20,4519 @@
  * SOFTWARE.
  */
 
+#include <fnmatch.h>
+#include <limits.h>
+#include <pthread.h>
 #include <stdlib.h>
+#include <string.h>
+#include <strings.h>
 #include <time.h>
+
+/* The GCRA core is compiled along with the module, so that it is inlined */
+#define RATER_API static inline
+#include "rater.c"
+
+/* RATER.WAIT blocks clients, which is still part of the experimental API in
+ * the bundled redismodule.h */
+#define REDISMODULE_EXPERIMENTAL_API
 #include "redismodule.h"
 
-/* Users can decide what's more important to them:
- *  1. the ability to maintain existing limits when a failover process is
- *     initiated by Redis Sentinel.
- *  2. incorrect rate-limits due to changes in the system time-of-day clock.
- *
- * By default, we prefer to use the realtime clock (1) rather than the monotonic
- * clock (2).
- */
-#ifdef USE_MONOTONIC_CLOCK
-#define RATE_LIMITER_CLOCK CLOCK_MONOTONIC
-#else /*!USE_MONOTONIC_CLOCK*/
-#define RATE_LIMITER_CLOCK CLOCK_REALTIME
-#endif /*USE_MONOTONIC_CLOCK*/
+/* The clock actually read by get_nanos. Loading the module with "CLOCK coarse"
+ * switches to the coarse variant of RATE_LIMITER_CLOCK, where available, which
+ * is cheaper to read but only advances once per kernel tick: its readings lag
+ * by up to its resolution, usually 1 to 4 milliseconds, and so may the
+ * decisions of the limiter. That is negligible for periods of a second or more.
+ */
+static clockid_t rater_clock = RATE_LIMITER_CLOCK;
+
+/* get_nanos returns the nanosecond-precise time of the specified clock
+ * (rater_clock). This clock could be either a realtime clock (default)
+ * or a monotonic clock, depending on the requirements of the user.
+ *
+ * Commands read it once, and keys evaluated by the same command share that
+ * reading.
+ */
+static long long get_nanos() { return rater_clock_nanos(rater_clock); }
+
+/* Theoretical arrival times are stored as decimal strings unless the module is
+ * loaded with "STORAGE native", in which case new keys hold a rater-tat value
+ * instead. Keys of either kind are always understood, so switching back and
+ * forth doesn't lose any limit. */
+#define RATER_STORAGE_STRING 0
+#define RATER_STORAGE_NATIVE 1
+
+static int rater_storage = RATER_STORAGE_STRING;
+
+/* The native rater-tat type keeps the theoretical arrival time as a plain
+ * integer, and nothing else: the parameters come with every call. */
+static RedisModuleType *RaterType;
+
+#define RATER_TYPE_ENCVER 0
+
+typedef struct rater_value {
+  long long tat;
+} rater_value;
+
+static void *rater_type_rdb_load(RedisModuleIO *rdb, int encver) {
+  if (encver != RATER_TYPE_ENCVER) {
+    RedisModule_LogIOError(rdb, "warning",
+                           "Can't load rater-tat with encver %d", encver);
+    return NULL;
+  }
+  rater_value *value = RedisModule_Alloc(sizeof(*value));
+  value->tat = RedisModule_LoadSigned(rdb);
+  return value;
+}
+
+static void rater_type_rdb_save(RedisModuleIO *rdb, void *ptr) {
+  rater_value *value = ptr;
+  RedisModule_SaveSigned(rdb, value->tat);
+}
+
+/* The expire of the key is rewritten by Redis itself, right after the commands
+ * emitted here. */
+static void rater_type_aof_rewrite(RedisModuleIO *aof, RedisModuleString *key,
+                                   void *ptr) {
+  rater_value *value = ptr;
+  RedisModule_EmitAOF(aof, "RATER.SET", "sl", key, value->tat);
+}
+
+static size_t rater_type_mem_usage(const void *ptr) {
+  REDISMODULE_NOT_USED(ptr);
+  return sizeof(rater_value);
+}
+
+static void rater_type_digest(RedisModuleDigest *md, void *ptr) {
+  rater_value *value = ptr;
+  RedisModule_DigestAddLongLong(md, value->tat);
+  RedisModule_DigestEndSequence(md);
+}
+
+static void rater_type_free(void *ptr) { RedisModule_Free(ptr); }
+
+/* rater_arg_is tells if arg is the given keyword, ignoring case. */
+static int rater_arg_is(RedisModuleString *arg, const char *name) {
+  size_t len;
+  const char *str = RedisModule_StringPtrLen(arg, &len);
+  return len == strlen(name) && strncasecmp(str, name, len) == 0;
+}
+
+/* Algorithms a limit can be enforced with, GCRA unless told otherwise. */
+#define RATER_ALGO_GCRA 0
+#define RATER_ALGO_FIXED 1
+#define RATER_ALGO_SLIDING 2
+
+static const char *rater_algo_names[] = {"gcra", "fixed", "sliding", NULL};
+
+/* Limits can be scaled at runtime with RATER.SCALE, which multiplies the
+ * count per period of every limit by the global factor, and that of policies
+ * by their own factor too, so that they tighten when a backend is degraded
+ * without any client sending different parameters. Every change bumps the
+ * epoch, invalidating the params computed with the previous factors. */
+static double rater_scale_factor = 1;
+static unsigned long long rater_scale_epoch = 0;
+
+/* Largest factor a limit can be scaled by */
+#define RATER_SCALE_MAX 1000
+
+/* Feedback reported with RATER.SCALE OVERLOAD divides a factor by
+ * rater_scale_decrease down to rater_scale_min, and RATER.SCALE RECOVER adds
+ * rater_scale_increase back up to 1, as in additive-increase/multiplicative-
+ * decrease congestion control. */
+static double rater_scale_decrease = 2;
+static double rater_scale_increase = 0.1;
+static double rater_scale_min = 0.01;
+
+/* rater_params_scale multiplies the count per period of params by factor,
+ * keeping at least a unit per period. */
+static void rater_params_scale(rater_params *params, double factor) {
+  if (factor == 1) return;
+
+  double count = params->count_per_period * factor;
+  long long scaled = 1;
+  if (count >= (double) LLONG_MAX) {
+    scaled = LLONG_MAX;
+  } else if (count >= 1) {
+    scaled = (long long) count;
+  }
+  int algo = params->algo;
+  rater_params_init(params, params->burst, scaled, params->period_in_sec);
+  params->algo = algo;
+}
+
+/* Clients tend to use a handful of distinct limits over and over, so the
+ * params of recently used limits are kept in a small direct-mapped cache,
+ * indexed by a hash of the parameters given by the user. Slots keep those
+ * parameters apart, as the cached params are scaled. */
+#define RATER_PARAMS_CACHE_SIZE 256
+
+typedef struct rater_params_slot {
+  long long burst, count_per_period, period_in_sec;
+  unsigned long long epoch;
+  rater_params params;
+} rater_params_slot;
+
+static rater_params_slot rater_params_cache[RATER_PARAMS_CACHE_SIZE];
+
+/* rater_params_get fills params for the given limit, scaled by the global
+ * factor, from the cache, computing and caching it on a miss. params is a
+ * copy, so that it stays valid whatever other limits are looked up
+ * afterwards. */
+static void rater_params_get(rater_params *params, long long burst,
+                             long long count_per_period,
+                             long long period_in_sec) {
+  unsigned long long h = (unsigned long long) burst * 0x9E3779B97F4A7C15ULL ^
+                         (unsigned long long) count_per_period *
+                             0xC2B2AE3D27D4EB4FULL ^
+                         (unsigned long long) period_in_sec *
+                             0x165667B19E3779F9ULL;
+  rater_params_slot *cached =
+      &rater_params_cache[(h ^ (h >> 32)) % RATER_PARAMS_CACHE_SIZE];
+
+  /* count_per_period is never 0 for a valid limit, which tells apart the
+   * slots that were never filled. */
+  if (cached->count_per_period != count_per_period ||
+      cached->burst != burst || cached->period_in_sec != period_in_sec ||
+      cached->epoch != rater_scale_epoch) {
+    cached->burst = burst;
+    cached->count_per_period = count_per_period;
+    cached->period_in_sec = period_in_sec;
+    cached->epoch = rater_scale_epoch;
+    rater_params_init(&cached->params, burst, count_per_period, period_in_sec);
+    rater_params_scale(&cached->params, rater_scale_factor);
+  }
+  *params = cached->params;
+}
+
+/* Longest decimal representation of a long long, sign included. */
+#define RATER_TAT_MAXLEN 20
+
+/* rater_parse_tat parses the len bytes at buf as a long long, accepting the
+ * same strict format as RedisModule_StringToLongLong: an optional minus sign
+ * followed by digits, with no leading zeros, spaces or plus sign. Returns 0
+ * on success and -1 otherwise. */
+static int rater_parse_tat(const char *buf, size_t len, long long *tat) {
+  if (len == 0 || len > RATER_TAT_MAXLEN) return -1;
+  if (len == 1 && buf[0] == '0') {
+    *tat = 0;
+    return 0;
+  }
+
+  int negative = buf[0] == '-';
+  size_t i = negative ? 1 : 0;
+  if (i == len || buf[i] < '1' || buf[i] > '9') return -1;
+
+  /* Up to 19 digits always fit an unsigned long long, and no long long has
+   * more than that, so there is no need to check for overflow digit by
+   * digit. */
+  if (len - i > 19) return -1;
+  unsigned long long v = 0;
+  for (; i < len; i++) {
+    if (buf[i] < '0' || buf[i] > '9') return -1;
+    v = v * 10 + (buf[i] - '0');
+  }
+
+  if (negative) {
+    if (v > (unsigned long long) LLONG_MAX + 1) return -1;
+    *tat = (long long) (0 - v);
+  } else {
+    if (v > (unsigned long long) LLONG_MAX) return -1;
+    *tat = (long long) v;
+  }
+  return 0;
+}
+
+/* rater_format_tat writes the decimal representation of the positive tat to
+ * buf, which must hold at least RATER_TAT_MAXLEN bytes, returning its length.
+ * No terminating null byte is written. */
+static size_t rater_format_tat(char *buf, long long tat) {
+  char tmp[RATER_TAT_MAXLEN];
+  size_t len = 0;
+  unsigned long long v = tat;
+  do {
+    tmp[sizeof(tmp) - ++len] = '0' + v % 10;
+    v /= 10;
+  } while (v);
+  memcpy(buf, tmp + sizeof(tmp) - len, len);
+  return len;
+}
+
+/* rater_get_tat reads the theoretical arrival time stored on key, which must
+ * be empty, hold a string or a rater-tat value. Returns NULL on success or the
+ * error message that should be replied to the client. */
+static const char *rater_get_tat(RedisModuleKey *key, long long *tat) {
+  *tat = 0;
+  int type = RedisModule_KeyType(key);
+  if (type == REDISMODULE_KEYTYPE_MODULE &&
+      RedisModule_ModuleTypeGetType(key) == RaterType) {
+    rater_value *value = RedisModule_ModuleTypeGetValue(key);
+    *tat = value->tat;
+  } else if (type == REDISMODULE_KEYTYPE_STRING) {
+    /* Parse straight from the string of the key, instead of copying it into a
+     * RedisModuleString just to call RedisModule_StringToLongLong. */
+    size_t len;
+    const char *raw_tat_str =
+        RedisModule_StringDMA(key, &len, REDISMODULE_READ);
+    if (rater_parse_tat(raw_tat_str, len, tat) != 0) {
+      return "ERR invalid stored rater";
+    }
+  } else if (type != REDISMODULE_KEYTYPE_EMPTY) {
+    /* If the key is not a rater and is not empty it is the wrong type. */
+    return REDISMODULE_ERRORMSG_WRONGTYPE;
+  }
+  return NULL;
+}
+
+/* rater_set_native stores tat on key as a rater-tat value, updating the value
+ * in place when the key already holds one. */
+static void rater_set_native(RedisModuleKey *key, long long tat) {
+  rater_value *value;
+  if (RedisModule_KeyType(key) == REDISMODULE_KEYTYPE_MODULE &&
+      RedisModule_ModuleTypeGetType(key) == RaterType) {
+    value = RedisModule_ModuleTypeGetValue(key);
+  } else {
+    value = RedisModule_Calloc(1, sizeof(*value));
+    RedisModule_ModuleTypeSetValue(key, RaterType, value);
+  }
+  value->tat = tat;
+}
+
+/* Keys are expired once their theoretical arrival time has passed, as their
+ * state is then the same as that of a missing key. The expire is normally
+ * moved forward on every write, but when the module is loaded with
+ * "EXPIRE-SLACK <ms>" it is set that much later than needed instead, and left
+ * alone while it is still within that slack. A hot key then has its expire
+ * rewritten once per slack, rather than on every call, for keys that linger up
+ * to the slack after recovering. */
+static long long rater_expire_slack = 0;
+
+/* rater_set_expire expires key after at least ttl milliseconds. Returns the
+ * ttl the key is left with, which is what replicas must be sent for them to
+ * expire the key along with the primary. */
+static long long rater_set_expire(RedisModuleKey *key, long long ttl) {
+  if (rater_expire_slack > 0 && ttl != REDISMODULE_NO_EXPIRE) {
+    mstime_t current = RedisModule_GetExpire(key);
+    if (current != REDISMODULE_NO_EXPIRE && current >= ttl &&
+        current <= ttl + rater_expire_slack) {
+      return current;
+    }
+    ttl += rater_expire_slack;
+  }
+  RedisModule_SetExpire(key, ttl);
+  return ttl;
+}
+
+/* rater_store_tat stores tat on key, leaving its expire to the caller.
+ * Keys already holding a rater-tat value keep that type regardless of the
+ * storage setting. Returns 1 if tat was stored as a rater-tat value and 0 if
+ * as a string. */
+static int rater_store_tat(RedisModuleKey *key, long long tat) {
+  if (rater_storage == RATER_STORAGE_NATIVE ||
+      RedisModule_KeyType(key) == REDISMODULE_KEYTYPE_MODULE) {
+    rater_set_native(key, tat);
+    return 1;
+  }
+
+  /* Write the digits straight into the string of the key, resizing it first
+   * if needed. On an empty key this creates the string, and as theoretical
+   * arrival times rarely change their number of digits the string is almost
+   * always rewritten in place. */
+  char buf[RATER_TAT_MAXLEN];
+  size_t len = rater_format_tat(buf, tat);
+  size_t old_len = 0;
+  if (RedisModule_KeyType(key) == REDISMODULE_KEYTYPE_STRING) {
+    old_len = RedisModule_ValueLength(key);
+  }
+  if (old_len != len) {
+    RedisModule_StringTruncate(key, len);
+  }
+  char *dma = RedisModule_StringDMA(key, &old_len, REDISMODULE_WRITE);
+  memcpy(dma, buf, len);
+  return 0;
+}
+
+/* rater_is_rater_key tells if key is empty or holds something rater could
+ * have stored, so that it can be overwritten by it. */
+static int rater_is_rater_key(RedisModuleKey *key) {
+  int type = RedisModule_KeyType(key);
+  return type == REDISMODULE_KEYTYPE_EMPTY ||
+         type == REDISMODULE_KEYTYPE_STRING ||
+         RedisModule_ModuleTypeGetType(key) == RaterType;
+}
+
+/* rater_put_int64 and rater_get_int64 convert between a long long and its 8
+ * bytes in little-endian order, for binary payloads. */
+static void rater_put_int64(char *buf, long long v) {
+  unsigned long long u = v;
+  for (int i = 0; i < 8; i++) {
+    buf[i] = (char) (u >> (8 * i));
+  }
+}
+
+static long long rater_get_int64(const char *buf) {
+  unsigned long long u = 0;
+  for (int i = 0; i < 8; i++) {
+    u |= (unsigned long long) (unsigned char) buf[i] << (8 * i);
+  }
+  return (long long) u;
+}
+
+/* How writes are propagated to replicas and the AOF, chosen with the
+ * REPLICATION module argument:
+ *  - RATER_REPLICATION_COMMANDS replicates string keys as PSETEX and native
+ *    keys as RATER.SET, which any replica understands.
+ *  - RATER_REPLICATION_COMPACT replicates every key as RATER.SYNC, whose state
+ *    is a single binary argument holding the theoretical arrival time and the
+ *    absolute expire of the key.
+ *
+ * With COMPACT, a COALESCE interval in milliseconds can also be given: written
+ * keys are then only collected, and replicated once per interval with their
+ * state at that time, however many times they were written. Replicas and the
+ * AOF lag by up to that interval. */
+#define RATER_REPLICATION_COMMANDS 0
+#define RATER_REPLICATION_COMPACT 1
+
+static int rater_replication = RATER_REPLICATION_COMMANDS;
+static long long rater_coalesce = 0;
+
+/* Length of the state argument of RATER.SYNC. */
+#define RATER_SYNC_STATE_LEN 16
+
+/* Keys written since the last flush when coalescing, as the selected db
+ * followed by the key name. */
+static RedisModuleDict *rater_pending;
+
+#ifndef USE_MONOTONIC_CLOCK
+static int rater_pending_armed = 0;
+
+/* rater_sync replicates the state of a key as RATER.SYNC. ttl is in
+ * milliseconds, or REDISMODULE_NO_EXPIRE. */
+static void rater_sync(RedisModuleCtx *ctx, RedisModuleString *keyname,
+                       long long tat, long long ttl) {
+  char state[RATER_SYNC_STATE_LEN];
+  rater_put_int64(state, tat);
+  rater_put_int64(state + 8, ttl == REDISMODULE_NO_EXPIRE
+                                 ? REDISMODULE_NO_EXPIRE
+                                 : RedisModule_Milliseconds() + ttl);
+  RedisModule_Replicate(ctx, "RATER.SYNC", "sb", keyname, state,
+                        sizeof(state));
+}
+
+/* rater_flush_pending replicates the current state of the keys written since
+ * the last flush. */
+static void rater_flush_pending(RedisModuleCtx *ctx, void *data) {
+  REDISMODULE_NOT_USED(data);
+  rater_pending_armed = 0;
+
+  RedisModuleDictIter *iter =
+      RedisModule_DictIteratorStartC(rater_pending, "^", NULL, 0);
+  char *entry;
+  size_t len;
+  while ((entry = RedisModule_DictNextC(iter, &len, NULL))) {
+    int db;
+    memcpy(&db, entry, sizeof(db));
+    RedisModuleString *keyname =
+        RedisModule_CreateString(ctx, entry + sizeof(db), len - sizeof(db));
+    RedisModule_SelectDb(ctx, db);
+
+    /* Keys deleted or overwritten since were replicated by whatever did it. */
+    RedisModuleKey *key = RedisModule_OpenKey(ctx, keyname, REDISMODULE_READ);
+    long long tat = 0;
+    if (RedisModule_KeyType(key) != REDISMODULE_KEYTYPE_EMPTY &&
+        rater_get_tat(key, &tat) == NULL) {
+      rater_sync(ctx, keyname, tat, RedisModule_GetExpire(key));
+    }
+    RedisModule_CloseKey(key);
+    RedisModule_FreeString(ctx, keyname);
+  }
+  RedisModule_DictIteratorStop(iter);
+
+  RedisModule_FreeDict(NULL, rater_pending);
+  rater_pending = RedisModule_CreateDict(NULL);
+}
+#endif /*USE_MONOTONIC_CLOCK*/
+
+/* rater_db_entry returns the selected db followed by keyname, which tells keys
+ * apart across dbs in dicts. It is allocated from the pool of ctx. */
+static char *rater_db_entry(RedisModuleCtx *ctx, RedisModuleString *keyname,
+                            size_t *len) {
+  int db = RedisModule_GetSelectedDb(ctx);
+  size_t name_len;
+  const char *name = RedisModule_StringPtrLen(keyname, &name_len);
+  char *entry = RedisModule_PoolAlloc(ctx, sizeof(db) + name_len);
+  memcpy(entry, &db, sizeof(db));
+  memcpy(entry + sizeof(db), name, name_len);
+  *len = sizeof(db) + name_len;
+  return entry;
+}
+
+/* rater_propagate replicates a write of tat on the key named keyname. */
+static void rater_propagate(RedisModuleCtx *ctx, RedisModuleString *keyname,
+                            long long tat, long long ttl, int native) {
+#ifndef USE_MONOTONIC_CLOCK
+  /* Check https://github.com/redis/redis/issues/8608 for more */
+  if (rater_replication == RATER_REPLICATION_COMMANDS) {
+    if (native) {
+      RedisModule_Replicate(ctx, "RATER.SET", "sll", keyname, tat, ttl);
+    } else {
+      char buf[RATER_TAT_MAXLEN];
+      size_t len = rater_format_tat(buf, tat);
+      RedisModule_Replicate(ctx, "PSETEX", "slb", keyname, ttl, buf, len);
+    }
+  } else if (rater_coalesce == 0) {
+    rater_sync(ctx, keyname, tat, ttl);
+  } else {
+    size_t len;
+    char *entry = rater_db_entry(ctx, keyname, &len);
+    RedisModule_DictSetC(rater_pending, entry, len, NULL);
+
+    if (!rater_pending_armed) {
+      RedisModule_CreateTimer(ctx, rater_coalesce, rater_flush_pending, NULL);
+      rater_pending_armed = 1;
+    }
+  }
+#else /*!USE_MONOTONIC_CLOCK*/
+  REDISMODULE_NOT_USED(ctx);
+  REDISMODULE_NOT_USED(keyname);
+  REDISMODULE_NOT_USED(tat);
+  REDISMODULE_NOT_USED(ttl);
+  REDISMODULE_NOT_USED(native);
+#endif /*USE_MONOTONIC_CLOCK*/
+}
+
+/* rater_check_limit tells if a limit is valid, returning NULL if so or the
+ * error message that should be replied to the client. */
+static const char *rater_check_limit(long long burst, long long count_per_period,
+                                     long long period_in_sec) {
+  if (burst < 0 || burst == LLONG_MAX) return "ERR invalid burst";
+  if (count_per_period <= 0) return "ERR invalid count_per_period";
+  if (period_in_sec <= 0) return "ERR invalid period_in_sec";
+  return NULL;
+}
+
+/* rater_parse_limit_args parses the <burst> <count per period> <period>
+ * triple found at argv, in their order. Returns NULL on success or the error
+ * message that should be replied to the client. */
+static const char *rater_parse_limit_args(RedisModuleString **argv,
+                                          long long *burst,
+                                          long long *count_per_period,
+                                          long long *period_in_sec) {
+  if (RedisModule_StringToLongLong(argv[0], burst) != REDISMODULE_OK) {
+    return "ERR invalid burst";
+  }
+  if (RedisModule_StringToLongLong(argv[1], count_per_period) !=
+      REDISMODULE_OK) {
+    return "ERR invalid count_per_period";
+  }
+  if (RedisModule_StringToLongLong(argv[2], period_in_sec) != REDISMODULE_OK) {
+    return "ERR invalid period_in_sec";
+  }
+  return rater_check_limit(*burst, *count_per_period, *period_in_sec);
+}
+
+/* rater_parse_limit parses the triple found at argv into params, scaled by
+ * the global factor. */
+static const char *rater_parse_limit(RedisModuleString **argv,
+                                     rater_params *params) {
+  long long burst = 0, count_per_period = 0, period_in_sec = 0;
+  const char *err =
+      rater_parse_limit_args(argv, &burst, &count_per_period, &period_in_sec);
+  if (err) return err;
+
+  rater_params_get(params, burst, count_per_period, period_in_sec);
+  return NULL;
+}
+
+/* rater_parse_quantity parses a <quantity> argument. */
+static const char *rater_parse_quantity(RedisModuleString *arg,
+                                        long long *quantity) {
+  if (RedisModule_StringToLongLong(arg, quantity) != REDISMODULE_OK ||
+      *quantity < 0) {
+    return "ERR invalid quantity";
+  }
+  return NULL;
+}
+
+/* Commands take the time to evaluate limits at with "NOW <nanoseconds>" only
+ * when the module is loaded with "ALLOW-NOW yes", so that recorded traffic can
+ * be replayed faster than it happened, see bench/replay.c. Keys still expire
+ * on the clock of Redis, which is only ever later than they would have. */
+static int rater_allow_now = 0;
+
+/* Shapes of replies, chosen with the REPLY option. The array of integers is
+ * the default, while limited and retry reply with that field alone, blob with
+ * every field packed in a string and map with a map of field names to values.
+ */
+#define RATER_REPLY_ARRAY 0
+#define RATER_REPLY_LIMITED 1
+#define RATER_REPLY_RETRY 2
+#define RATER_REPLY_BLOB 3
+#define RATER_REPLY_MAP 4
+
+static const char *rater_reply_names[] = {"array", "limited", "retry", "blob",
+                                          "map", NULL};
+
+/* Options that may follow the arguments of a command, as <name> <value>
+ * pairs or flags on their own. */
+typedef struct rater_options {
+  /* Nanoseconds per unit of retry_after and reset in replies */
+  long long unit;
+  /* RATER_ALGO_* overriding that of the limit, or -1 */
+  int algo;
+  /* Whether replies end with the absolute time the call is allowed at */
+  int allow_at;
+  /* RATER_REPLY_* shape of the reply */
+  int reply;
+  /* Clock reading the command is evaluated at, taken when parsing unless
+   * given with NOW */
+  long long now;
+  int now_given;
+  /* Whether UNIT was given, as policies have a unit of their own */
+  int unit_given;
+} rater_options;
+
+static const rater_options rater_default_options = {.unit = NSEC_PER_SEC,
+                                                    .algo = -1};
+
+/* rater_is_option tells if arg names an option rather than being a
+ * positional argument. */
+static int rater_is_option(RedisModuleString *arg) {
+  return rater_arg_is(arg, "unit") || rater_arg_is(arg, "algo") ||
+         rater_arg_is(arg, "allowat") || rater_arg_is(arg, "reply") ||
+         rater_arg_is(arg, "now");
+}
+
+/* rater_parse_name finds arg among the NULL terminated names, returning
+ * whether it is there. */
+static int rater_parse_name(RedisModuleString *arg, const char **names,
+                            int *index) {
+  for (int i = 0; names[i] != NULL; i++) {
+    if (rater_arg_is(arg, names[i])) {
+      *index = i;
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/* rater_parse_algo parses the name of an algorithm. */
+static const char *rater_parse_algo(RedisModuleString *arg, int *algo) {
+  if (!rater_parse_name(arg, rater_algo_names, algo)) {
+    return "ERR invalid algo, expected gcra, fixed or sliding";
+  }
+  return NULL;
+}
+
+static const char *rater_unit_names[] = {"s", "ms", "us", NULL};
+static const long long rater_unit_nanos[] = {NSEC_PER_SEC, NSEC_PER_MSEC,
+                                             NSEC_PER_USEC};
+
+/* rater_parse_unit parses the name of a unit into its length in
+ * nanoseconds. */
+static const char *rater_parse_unit(RedisModuleString *arg, long long *unit) {
+  int index;
+  if (!rater_parse_name(arg, rater_unit_names, &index)) {
+    return "ERR invalid unit, expected s, ms or us";
+  }
+  *unit = rater_unit_nanos[index];
+  return NULL;
+}
+
+/* rater_unit_name returns the name of a unit given in nanoseconds. */
+static const char *rater_unit_name(long long unit) {
+  for (int i = 0; rater_unit_names[i] != NULL; i++) {
+    if (rater_unit_nanos[i] == unit) return rater_unit_names[i];
+  }
+  return NULL;
+}
+
+/* rater_parse_option parses the option at argv[*i], out of argc arguments,
+ * into options and moves *i past it. */
+static const char *rater_parse_option(RedisModuleString **argv, int argc,
+                                      int *i, rater_options *options) {
+  if (rater_arg_is(argv[*i], "allowat")) {
+    options->allow_at = 1;
+    *i += 1;
+    return NULL;
+  }
+  if (!rater_is_option(argv[*i]) || *i + 1 >= argc) {
+    return "ERR syntax error";
+  }
+
+  RedisModuleString *value = argv[*i + 1];
+  if (rater_arg_is(argv[*i], "algo")) {
+    const char *err = rater_parse_algo(value, &options->algo);
+    if (err) return err;
+  } else if (rater_arg_is(argv[*i], "reply")) {
+    if (!rater_parse_name(value, rater_reply_names, &options->reply)) {
+      return "ERR invalid reply, expected array, limited, retry, blob or map";
+    }
+  } else if (rater_arg_is(argv[*i], "now")) {
+    if (!rater_allow_now) {
+      return "ERR NOW is disabled, load the module with ALLOW-NOW yes";
+    }
+    if (RedisModule_StringToLongLong(value, &options->now) != REDISMODULE_OK ||
+        options->now <= 0) {
+      return "ERR invalid now";
+    }
+    options->now_given = 1;
+  } else {
+    const char *err = rater_parse_unit(value, &options->unit);
+    if (err) return err;
+    options->unit_given = 1;
+  }
+  *i += 2;
+  return NULL;
+}
+
+/* rater_parse_options parses the argc arguments at argv as options. */
+static const char *rater_parse_options(RedisModuleString **argv, int argc,
+                                       rater_options *options) {
+  *options = rater_default_options;
+  options->now = get_nanos();
+  for (int i = 0; i < argc;) {
+    const char *err = rater_parse_option(argv, argc, &i, options);
+    if (err) return err;
+  }
+  return NULL;
+}
+
+/* rater_parse_tail parses the argc arguments at argv that follow a limit: an
+ * optional quantity, 1 unless given, followed by options. */
+static const char *rater_parse_tail(RedisModuleString **argv, int argc,
+                                    long long *quantity,
+                                    rater_options *options) {
+  *quantity = 1;
+  if (argc > 0 && !rater_is_option(argv[0])) {
+    const char *err = rater_parse_quantity(argv[0], quantity);
+    if (err) return err;
+    argv++;
+    argc--;
+  }
+  return rater_parse_options(argv, argc, options);
+}
+
+/* rater_gcra_only fails options given to commands that only implement GCRA. */
+static const char *rater_gcra_only(const rater_options *options) {
+  if (options->algo > RATER_ALGO_GCRA) {
+    return "ERR only the gcra algo is supported by this command";
+  }
+  return NULL;
+}
+
+/* rater_in_unit converts nanoseconds to the unit of options. Seconds are
+ * rounded down as they always were, while smaller units are rounded up so that
+ * clients backing off that long are not limited again. Negative values, which
+ * tell there is nothing to wait for, are left as is. */
+static long long rater_in_unit(long long nanos, const rater_options *options) {
+  if (nanos < 0) return nanos;
+  if (options->unit == NSEC_PER_SEC) return nanos / NSEC_PER_SEC;
+  return nanos / options->unit + (nanos % options->unit != 0);
+}
+
+/* A field some replies have after the five of rater_limit. */
+typedef struct rater_field {
+  const char *name;
+  long long value;
+} rater_field;
+
+#define RATER_REPLY_MAXFIELDS 8
+
+/* Fields of blob replies are unsigned LEB128 varints of their value plus one,
+ * as none is below -1, which makes for 1 to 10 bytes each. */
+static size_t rater_put_varint(char *buf, long long v) {
+  unsigned long long u = (unsigned long long) v + 1;
+  size_t len = 0;
+  while (u >= 0x80) {
+    buf[len++] = (char) (u | 0x80);
+    u >>= 7;
+  }
+  buf[len++] = (char) u;
+  return len;
+}
+
+/* rater_reply_extended sends the result of rater_limit, followed by count more
+ * fields, in the shape chosen by options. */
+static void rater_reply_extended(RedisModuleCtx *ctx, long long limited,
+                                 long long limit, long long remaining,
+                                 long long retry_after, long long ttl,
+                                 const rater_field *extra, int count,
+                                 const rater_options *options) {
+  rater_field fields[RATER_REPLY_MAXFIELDS] = {
+      /* Limited is 0 if not limited, 1 if limited. */
+      {"limited", limited},
+      /* Limit is burst + 1 */
+      {"limit", limit},
+      /* Remaining count ranges from zero to limit withing a period. */
+      {"remaining", remaining},
+      /* Retry after this many of seconds, or the unit of options, to get
+       * through or -1 if not limited. */
+      {"retry_after", rater_in_unit(retry_after, options)},
+      /* Amount of time to wait until both the burst and the rate restarts. */
+      {"reset", rater_in_unit(ttl, options)}};
+  int len = 5;
+  for (int i = 0; i < count; i++) {
+    fields[len++] = extra[i];
+  }
+  /* With ALLOWAT, the absolute time in nanoseconds, on the clock of the
+   * module, at which a limited call is allowed, or -1 if it isn't limited or
+   * never is allowed. Clients may cache a denial until then without asking
+   * again. */
+  if (options->allow_at) {
+    fields[len++] = (rater_field){
+        "allow_at", retry_after < 0 ? -1
+                                    : rater_saturate((__int128) options->now +
+                                                     retry_after)};
+  }
+
+  switch (options->reply) {
+  case RATER_REPLY_LIMITED:
+    RedisModule_ReplyWithLongLong(ctx, limited);
+    break;
+  case RATER_REPLY_RETRY:
+    RedisModule_ReplyWithLongLong(ctx, fields[3].value);
+    break;
+  case RATER_REPLY_BLOB: {
+    char buf[RATER_REPLY_MAXFIELDS * 10];
+    size_t buf_len = 0;
+    for (int i = 0; i < len; i++) {
+      buf_len += rater_put_varint(buf + buf_len, fields[i].value);
+    }
+    RedisModule_ReplyWithStringBuffer(ctx, buf, buf_len);
+    break;
+  }
+  case RATER_REPLY_MAP:
+    /* Maps are flattened to arrays on RESP2, and before Redis 7.0 */
+    if (RedisModule_ReplyWithMap != NULL) {
+      RedisModule_ReplyWithMap(ctx, len);
+    } else {
+      RedisModule_ReplyWithArray(ctx, len * 2);
+    }
+    for (int i = 0; i < len; i++) {
+      RedisModule_ReplyWithSimpleString(ctx, fields[i].name);
+      RedisModule_ReplyWithLongLong(ctx, fields[i].value);
+    }
+    break;
+  default:
+    RedisModule_ReplyWithArray(ctx, len);
+    for (int i = 0; i < len; i++) {
+      RedisModule_ReplyWithLongLong(ctx, fields[i].value);
+    }
+  }
+}
+
+/* rater_reply sends the result of rater_limit, as an array of integers unless
+ * options choose otherwise. */
+static void rater_reply(RedisModuleCtx *ctx, long long limited,
+                        long long limit, long long remaining,
+                        long long retry_after, long long ttl,
+                        const rater_options *options) {
+  rater_reply_extended(ctx, limited, limit, remaining, retry_after, ttl, NULL,
+                       0, options);
+}
+
+/* Keys limited the most are tracked with the Space-Saving algorithm, when the
+ * module is loaded with "TOPK <k>": k counters are kept, and a key that isn't
+ * counted yet takes over the counter of the least limited one, inheriting its
+ * count as the error of the estimate. Any key limited more than 1/k of the
+ * time is guaranteed to be counted.
+ *
+ * Counters are grouped in buckets of equal counts, sorted by count (the
+ * "stream summary"), so that counting is O(1), and found through an open
+ * addressing index of their hashes. Everything is allocated on load, and key
+ * names are kept up to RATER_TOPK_KEYLEN bytes. */
+#define RATER_TOPK_MAX 100000
+#define RATER_TOPK_KEYLEN 64
+
+typedef struct rater_topk_bucket {
+  long long count;
+  int first;      /* First counter in the bucket */
+  int prev, next; /* Buckets with lower and higher counts, or -1 */
+} rater_topk_bucket;
+
+typedef struct rater_topk_counter {
+  uint64_t hash;
+  long long error;
+  int bucket;
+  int prev, next; /* Counters in the same bucket, or -1 */
+  size_t len;
+  char name[RATER_TOPK_KEYLEN];
+} rater_topk_counter;
+
+static struct {
+  int k, size;
+  int min_bucket, free_bucket;
+  rater_topk_bucket *buckets;
+  rater_topk_counter *counters;
+  int *index; /* Counter + 1, or 0 for an empty slot */
+  uint64_t index_mask;
+} rater_topk;
+
+/* rater_hash is the 64-bit FNV-1a hash of buf, with an optional seed. */
+static uint64_t rater_hash(const char *buf, size_t len, uint64_t seed) {
+  uint64_t hash = 0xcbf29ce484222325ULL ^ seed;
+  for (size_t i = 0; i < len; i++) {
+    hash ^= (unsigned char) buf[i];
+    hash *= 0x100000001b3ULL;
+  }
+  return hash;
+}
+
+static void rater_topk_reset(void) {
+  rater_topk.size = 0;
+  rater_topk.min_bucket = -1;
+  rater_topk.free_bucket = 0;
+  for (int i = 0; i <= rater_topk.k; i++) {
+    rater_topk.buckets[i].next = i < rater_topk.k ? i + 1 : -1;
+  }
+  memset(rater_topk.index, 0,
+         sizeof(*rater_topk.index) * (rater_topk.index_mask + 1));
+}
+
+/* rater_topk_init allocates k counters, an extra bucket for the one created
+ * before the last counter leaves its old bucket, and an index at most half
+ * full. */
+static void rater_topk_init(int k) {
+  uint64_t slots = 2;
+  while (slots < (uint64_t) k * 2) slots <<= 1;
+
+  rater_topk.k = k;
+  rater_topk.buckets =
+      RedisModule_Calloc(k + 1, sizeof(*rater_topk.buckets));
+  rater_topk.counters = RedisModule_Calloc(k, sizeof(*rater_topk.counters));
+  rater_topk.index = RedisModule_Calloc(slots, sizeof(*rater_topk.index));
+  rater_topk.index_mask = slots - 1;
+  rater_topk_reset();
+}
+
+/* rater_topk_free releases the counters, if any, which disables tracking. */
+static void rater_topk_free(void) {
+  if (rater_topk.k == 0) return;
+  RedisModule_Free(rater_topk.buckets);
+  RedisModule_Free(rater_topk.counters);
+  RedisModule_Free(rater_topk.index);
+  memset(&rater_topk, 0, sizeof(rater_topk));
+}
+
+/* rater_topk_slot returns the index slot of hash, or the empty slot where it
+ * belongs. */
+static uint64_t rater_topk_slot(uint64_t hash) {
+  uint64_t i = hash & rater_topk.index_mask;
+  while (rater_topk.index[i] &&
+         rater_topk.counters[rater_topk.index[i] - 1].hash != hash) {
+    i = (i + 1) & rater_topk.index_mask;
+  }
+  return i;
+}
+
+/* rater_topk_unindex empties slot i, moving back the entries after it that
+ * would no longer be reachable by linear probing. */
+static void rater_topk_unindex(uint64_t i) {
+  uint64_t mask = rater_topk.index_mask;
+  for (uint64_t j = (i + 1) & mask; rater_topk.index[j]; j = (j + 1) & mask) {
+    uint64_t home = rater_topk.counters[rater_topk.index[j] - 1].hash & mask;
+    if (((j - home) & mask) >= ((j - i) & mask)) {
+      rater_topk.index[i] = rater_topk.index[j];
+      i = j;
+    }
+  }
+  rater_topk.index[i] = 0;
+}
+
+/* rater_topk_bucket_at returns the bucket right after prev, or the first one
+ * when prev is -1, creating it unless it already holds count. */
+static int rater_topk_bucket_at(int prev, long long count) {
+  rater_topk_bucket *buckets = rater_topk.buckets;
+  int next = prev < 0 ? rater_topk.min_bucket : buckets[prev].next;
+  if (next >= 0 && buckets[next].count == count) return next;
+
+  int b = rater_topk.free_bucket;
+  rater_topk.free_bucket = buckets[b].next;
+  buckets[b] = (rater_topk_bucket){count, -1, prev, next};
+  if (next >= 0) buckets[next].prev = b;
+  if (prev >= 0) {
+    buckets[prev].next = b;
+  } else {
+    rater_topk.min_bucket = b;
+  }
+  return b;
+}
+
+/* rater_topk_move moves counter c to bucket b, releasing its old bucket when
+ * left empty. */
+static void rater_topk_move(int c, int b) {
+  rater_topk_bucket *buckets = rater_topk.buckets;
+  rater_topk_counter *counter = &rater_topk.counters[c];
+  int old = counter->bucket;
+
+  if (old >= 0) {
+    if (counter->prev >= 0) {
+      rater_topk.counters[counter->prev].next = counter->next;
+    } else {
+      buckets[old].first = counter->next;
+    }
+    if (counter->next >= 0) {
+      rater_topk.counters[counter->next].prev = counter->prev;
+    }
+
+    if (buckets[old].first < 0) {
+      if (buckets[old].prev >= 0) {
+        buckets[buckets[old].prev].next = buckets[old].next;
+      } else {
+        rater_topk.min_bucket = buckets[old].next;
+      }
+      if (buckets[old].next >= 0) {
+        buckets[buckets[old].next].prev = buckets[old].prev;
+      }
+      buckets[old].next = rater_topk.free_bucket;
+      rater_topk.free_bucket = old;
+    }
+  }
+
+  counter->bucket = b;
+  counter->prev = -1;
+  counter->next = buckets[b].first;
+  if (counter->next >= 0) rater_topk.counters[counter->next].prev = c;
+  buckets[b].first = c;
+}
+
+/* rater_topk_add counts a limited call of the key named keyname. */
+static void rater_topk_add(RedisModuleString *keyname) {
+  size_t len;
+  const char *name = RedisModule_StringPtrLen(keyname, &len);
+  uint64_t hash = rater_hash(name, len, 0);
+  uint64_t slot = rater_topk_slot(hash);
+
+  int c;
+  if (rater_topk.index[slot]) {
+    c = rater_topk.index[slot] - 1;
+  } else {
+    if (rater_topk.size < rater_topk.k) {
+      c = rater_topk.size++;
+      rater_topk.counters[c].bucket = -1;
+      rater_topk.counters[c].error = 0;
+    } else {
+      /* Take over a counter of the least limited key */
+      c = rater_topk.buckets[rater_topk.min_bucket].first;
+      rater_topk.counters[c].error =
+          rater_topk.buckets[rater_topk.min_bucket].count;
+      rater_topk_unindex(rater_topk_slot(rater_topk.counters[c].hash));
+      slot = rater_topk_slot(hash);
+    }
+
+    rater_topk_counter *counter = &rater_topk.counters[c];
+    counter->hash = hash;
+    counter->len = len < RATER_TOPK_KEYLEN ? len : RATER_TOPK_KEYLEN;
+    memcpy(counter->name, name, counter->len);
+    rater_topk.index[slot] = c + 1;
+  }
+
+  /* A counter taken over keeps its count, plus this call */
+  int bucket = rater_topk.counters[c].bucket;
+  long long count = bucket >= 0 ? rater_topk.buckets[bucket].count : 0;
+  rater_topk_move(c, rater_topk_bucket_at(bucket, count + 1));
+}
+
+/* Runtime statistics, reported by RATER.STATS and the rater INFO section.
+ * Commands only ever run on the main thread, so plain counters are enough.
+ *
+ * The latency histogram is log-linear, like HdrHistogram: every power of two
+ * of nanoseconds is split in RATER_HIST_SUB linear buckets, which keeps the
+ * error of any percentile under 1/RATER_HIST_SUB. Only one command out of
+ * RATER_HIST_SAMPLE is timed, to amortize the cost of reading the clock. */
+#define RATER_HIST_SUB_BITS 3
+#define RATER_HIST_SUB (1 << RATER_HIST_SUB_BITS)
+#define RATER_HIST_BUCKETS (RATER_HIST_SUB * 40)
+#define RATER_HIST_SAMPLE 16
+
+typedef struct rater_stats {
+  long long calls, allowed, limited, peeks, parse_errors, wrongtype;
+  long long samples;
+  long long latency[RATER_HIST_BUCKETS];
+  long long events_dropped;
+} rater_stats;
+
+static rater_stats rater_stat;
+
+static const char *rater_stats_names[] = {
+    "calls",          "allowed",        "limited",
+    "peeks",          "parse_errors",   "wrongtype",
+    "latency_samples", "latency_p50_ns", "latency_p99_ns",
+    "latency_p999_ns", "latency_max_ns", "events_dropped",
+    NULL};
+
+static long long rater_monotonic_nanos() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ((long long) ts.tv_sec) * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+static int rater_hist_bucket(unsigned long long ns) {
+  if (ns < RATER_HIST_SUB) return ns;
+  int shift = 63 - __builtin_clzll(ns) - RATER_HIST_SUB_BITS;
+  int bucket = (shift + 1) * RATER_HIST_SUB +
+               ((ns >> shift) & (RATER_HIST_SUB - 1));
+  return bucket < RATER_HIST_BUCKETS ? bucket : RATER_HIST_BUCKETS - 1;
+}
+
+/* rater_hist_value returns the highest latency counted by a bucket. */
+static long long rater_hist_value(int bucket) {
+  if (bucket < RATER_HIST_SUB) return bucket;
+  int shift = bucket / RATER_HIST_SUB - 1;
+  long long low = (long long) (RATER_HIST_SUB + bucket % RATER_HIST_SUB)
+                  << shift;
+  return low + (1LL << shift) - 1;
+}
+
+/* rater_hist_percentile returns the latency under which permille of the
+ * samples fall. */
+static long long rater_hist_percentile(int permille) {
+  long long rank = (rater_stat.samples * permille + 999) / 1000;
+  long long seen = 0;
+  for (int i = 0; i < RATER_HIST_BUCKETS; i++) {
+    seen += rater_stat.latency[i];
+    if (seen > 0 && seen >= rank) return rater_hist_value(i);
+  }
+  return 0;
+}
+
+/* rater_stats_values fills values in the order of rater_stats_names. */
+static void rater_stats_values(long long *values) {
+  values[0] = rater_stat.calls;
+  values[1] = rater_stat.allowed;
+  values[2] = rater_stat.limited;
+  values[3] = rater_stat.peeks;
+  values[4] = rater_stat.parse_errors;
+  values[5] = rater_stat.wrongtype;
+  values[6] = rater_stat.samples;
+  values[7] = rater_hist_percentile(500);
+  values[8] = rater_hist_percentile(990);
+  values[9] = rater_hist_percentile(999);
+  values[10] = rater_hist_percentile(1000);
+  values[11] = rater_stat.events_dropped;
+}
+
+/* rater_stats_start counts a call and returns when it started if it is sampled
+ * for latency, or 0. */
+static long long rater_stats_start(void) {
+  if (rater_stat.calls++ % RATER_HIST_SAMPLE != 0) return 0;
+  return rater_monotonic_nanos();
+}
+
+static void rater_stats_end(long long start) {
+  if (start == 0) return;
+  rater_stat.latency[rater_hist_bucket(rater_monotonic_nanos() - start)]++;
+  rater_stat.samples++;
+}
+
+/* With EVENTS <stream>, limited calls are also recorded on a capped stream of
+ * db 0, for anomaly detection and the like. One of every EVENTS-SAMPLE limited
+ * calls is kept, and kept events are batched and appended with XADD MAXLEN ~
+ * EVENTS-MAXLEN once per EVENTS-FLUSH milliseconds. At most
+ * RATER_EVENTS_BATCH events are kept per batch, further ones are dropped, which
+ * bounds the work per flush. Each entry has the key, db and quantity. */
+#define RATER_EVENTS_BATCH 1024
+
+typedef struct rater_event {
+  RedisModuleString *keyname;
+  int db;
+  long long quantity;
+} rater_event;
+
+static struct rater_events {
+  RedisModuleString *stream; /* NULL when disabled */
+  long long sample, maxlen, flush;
+  long long seen;
+  int armed;
+  int len;
+  rater_event batch[RATER_EVENTS_BATCH];
+} rater_events = {.sample = 1, .maxlen = 10000, .flush = 100};
+
+/* rater_events_flush appends the batched events to the stream. */
+static void rater_events_flush(RedisModuleCtx *ctx, void *data) {
+  REDISMODULE_NOT_USED(data);
+  rater_events.armed = 0;
+
+  RedisModule_SelectDb(ctx, 0);
+  for (int i = 0; i < rater_events.len; i++) {
+    rater_event *event = &rater_events.batch[i];
+    RedisModuleCallReply *reply = RedisModule_Call(
+        ctx, "XADD", "!scclccsclcl", rater_events.stream, "MAXLEN", "~",
+        rater_events.maxlen, "*", "key", event->keyname, "db",
+        (long long) event->db, "quantity", event->quantity);
+    if (reply) RedisModule_FreeCallReply(reply);
+    RedisModule_FreeString(NULL, event->keyname);
+  }
+  rater_events.len = 0;
+}
+
+/* rater_events_add records that the key named keyname was limited, if it is
+ * sampled. */
+static void rater_events_add(RedisModuleCtx *ctx, RedisModuleString *keyname,
+                             long long quantity) {
+  if (rater_events.seen++ % rater_events.sample != 0) return;
+  if (rater_events.len == RATER_EVENTS_BATCH) {
+    rater_stat.events_dropped++;
+    return;
+  }
+
+  rater_event *event = &rater_events.batch[rater_events.len++];
+  event->keyname = RedisModule_CreateStringFromString(NULL, keyname);
+  event->db = RedisModule_GetSelectedDb(ctx);
+  event->quantity = quantity;
+  if (!rater_events.armed) {
+    RedisModule_CreateTimer(ctx, rater_events.flush, rater_events_flush, NULL);
+    rater_events.armed = 1;
+  }
+}
+
+/* rater_stats_count counts the outcome of limiting the key named keyname. */
+static void rater_stats_count(RedisModuleCtx *ctx, RedisModuleString *keyname,
+                              long long quantity, long long limited) {
+  if (quantity == 0) {
+    rater_stat.peeks++;
+  } else if (limited) {
+    rater_stat.limited++;
+    if (rater_topk.k > 0) rater_topk_add(keyname);
+    if (rater_events.stream) rater_events_add(ctx, keyname, quantity);
+  } else {
+    rater_stat.allowed++;
+  }
+}
+
+static int rater_stats_parse_error(RedisModuleCtx *ctx, const char *err) {
+  rater_stat.parse_errors++;
+  return RedisModule_ReplyWithError(ctx, err);
+}
+
+/* rater_read_tat reads the theoretical arrival time stored on the key named
+ * keyname. The key is only opened for reading, so that limited calls and peeks
+ * leave it untouched as far as Redis is concerned: closing a key opened for
+ * writing signals it as modified, invalidating WATCH and client-side caches. */
+static const char *rater_read_tat(RedisModuleCtx *ctx,
+                                  RedisModuleString *keyname, long long *tat) {
+  RedisModuleKey *key = RedisModule_OpenKey(ctx, keyname, REDISMODULE_READ);
+  const char *err = rater_get_tat(key, tat);
+  RedisModule_CloseKey(key);
+  return err;
+}
+
+/* rater_write_tat stores a new theoretical arrival time on the key named
+ * keyname, expiring it after the ttl nanoseconds given by rater_limit, and
+ * propagates the write to replicas. The ttl is rounded up to milliseconds, so
+ * that keys never expire before their theoretical arrival time, nor right
+ * away, which PSETEX refuses. */
+static void rater_write_tat(RedisModuleCtx *ctx, RedisModuleString *keyname,
+                            long long tat, long long ttl) {
+  ttl = ttl > 0 ? ttl / NSEC_PER_MSEC + (ttl % NSEC_PER_MSEC != 0) : 1;
+  RedisModuleKey *key =
+      RedisModule_OpenKey(ctx, keyname, REDISMODULE_READ | REDISMODULE_WRITE);
+  int native = rater_store_tat(key, tat);
+  ttl = rater_set_expire(key, ttl);
+  RedisModule_CloseKey(key);
+  rater_propagate(ctx, keyname, tat, ttl, native);
+}
+
+/* Windows count calls in fixed periods aligned on the clock, for quotas such as
+ * a number of calls per calendar minute, which GCRA can't express. The fixed
+ * window algorithm allows count per period calls in every window, so up to
+ * twice that may pass around the start of a window. The sliding window
+ * algorithm also weighs the count of the previous window by how much of it
+ * still overlaps the last period, which smooths that out assuming calls were
+ * spread evenly. The burst is not used by either. Windows are kept in keys of
+ * the rater-win type, replicated and rewritten as RATER.WSET. */
+static RedisModuleType *RaterWindowType;
+
+#define RATER_WINDOW_ENCVER 0
+
+typedef struct rater_window {
+  long long start; /* of the current window, in nanoseconds */
+  long long count, prev;
+} rater_window;
+
+static void *rater_window_rdb_load(RedisModuleIO *rdb, int encver) {
+  if (encver != RATER_WINDOW_ENCVER) {
+    RedisModule_LogIOError(rdb, "warning",
+                           "Can't load rater-win with encver %d", encver);
+    return NULL;
+  }
+  rater_window *window = RedisModule_Alloc(sizeof(*window));
+  window->start = RedisModule_LoadSigned(rdb);
+  window->count = RedisModule_LoadSigned(rdb);
+  window->prev = RedisModule_LoadSigned(rdb);
+  return window;
+}
+
+static void rater_window_rdb_save(RedisModuleIO *rdb, void *ptr) {
+  rater_window *window = ptr;
+  RedisModule_SaveSigned(rdb, window->start);
+  RedisModule_SaveSigned(rdb, window->count);
+  RedisModule_SaveSigned(rdb, window->prev);
+}
+
+static void rater_window_aof_rewrite(RedisModuleIO *aof, RedisModuleString *key,
+                                     void *ptr) {
+  rater_window *window = ptr;
+  RedisModule_EmitAOF(aof, "RATER.WSET", "slll", key, window->start,
+                      window->count, window->prev);
+}
+
+static size_t rater_window_mem_usage(const void *ptr) {
+  REDISMODULE_NOT_USED(ptr);
+  return sizeof(rater_window);
+}
+
+static void rater_window_digest(RedisModuleDigest *md, void *ptr) {
+  rater_window *window = ptr;
+  RedisModule_DigestAddLongLong(md, window->start);
+  RedisModule_DigestAddLongLong(md, window->count);
+  RedisModule_DigestAddLongLong(md, window->prev);
+  RedisModule_DigestEndSequence(md);
+}
+
+static void rater_window_free(void *ptr) { RedisModule_Free(ptr); }
+
+/* rater_get_window reads the window of key into window, zeroed when the key is
+ * empty. */
+static const char *rater_get_window(RedisModuleKey *key, rater_window *window) {
+  memset(window, 0, sizeof(*window));
+  if (RedisModule_KeyType(key) == REDISMODULE_KEYTYPE_EMPTY) {
+    return NULL;
+  }
+  if (RedisModule_ModuleTypeGetType(key) != RaterWindowType) {
+    return REDISMODULE_ERRORMSG_WRONGTYPE;
+  }
+  *window = *(rater_window *) RedisModule_ModuleTypeGetValue(key);
+  return NULL;
+}
+
+/* rater_set_window stores window on key, which must be empty or hold a
+ * window. */
+static void rater_set_window(RedisModuleKey *key, const rater_window *window) {
+  rater_window *value;
+  if (RedisModule_KeyType(key) == REDISMODULE_KEYTYPE_MODULE) {
+    value = RedisModule_ModuleTypeGetValue(key);
+  } else {
+    value = RedisModule_Alloc(sizeof(*value));
+    RedisModule_ModuleTypeSetValue(key, RaterWindowType, value);
+  }
+  *value = *window;
+}
+
+/* rater_window_limit is the counterpart of rater_limit for windows: it applies
+ * quantity to window as of now, with the same outputs, and returns whether
+ * window was updated and should be stored. */
+static int rater_window_limit(const rater_params *params, rater_window *window,
+                              long long now, long long quantity,
+                              long long *limited, long long *limit,
+                              long long *remaining, long long *retry_after,
+                              long long *ttl) {
+  long long period =
+      rater_saturate((__int128) params->period_in_sec * NSEC_PER_SEC);
+  long long start = now - now % period;
+
+  /* Move the window forward, the current one becoming the previous one if
+   * they are adjacent. */
+  if (window->start != start) {
+    window->prev = window->start == start - period ? window->count : 0;
+    window->count = 0;
+    window->start = start;
+  }
+
+  /* The weight of the previous window is rounded up, so as to not let
+   * through more than the limit. */
+  long long elapsed = now - start;
+  long long used = window->count;
+  if (params->algo == RATER_ALGO_SLIDING && window->prev > 0) {
+    __int128 weighted = (__int128) window->prev * (period - elapsed);
+    used += (long long) ((weighted + period - 1) / period);
+  }
+
+  *limit = params->count_per_period;
+  *limited = quantity > *limit - used;
+  *retry_after = -1;
+  if (!*limited) {
+    window->count += quantity;
+    used += quantity;
+  } else if (quantity <= *limit) {
+    /* When the previous window weighs in, the call is allowed once enough of
+     * it slid out, or else once enough of the current one did in the next. */
+    if (params->algo == RATER_ALGO_FIXED) {
+      *retry_after = period - elapsed;
+    } else if (quantity <= *limit - window->count) {
+      __int128 room = (__int128) (*limit - window->count - quantity) * period;
+      *retry_after = period - (long long) (room / window->prev) - elapsed;
+    } else {
+      __int128 room = (__int128) (*limit - quantity) * period;
+      *retry_after = rater_saturate((__int128) 2 * period -
+                                    room / window->count - elapsed);
+    }
+  }
+  *remaining = used < *limit ? *limit - used : 0;
+
+  /* Counts are forgotten once out of the window */
+  if (window->count > 0 && params->algo == RATER_ALGO_SLIDING) {
+    *ttl = rater_saturate((__int128) 2 * period - elapsed);
+  } else if (window->count > 0 || window->prev > 0) {
+    *ttl = period - elapsed;
+  } else {
+    *ttl = 0;
+  }
+  return !*limited && quantity > 0;
+}
+
+/* rater_window_key is the counterpart of rater_limit_key for windows. */
+static int rater_window_key(RedisModuleCtx *ctx, RedisModuleString *keyname,
+                            const rater_params *params, long long quantity,
+                            const rater_options *options) {
+  RedisModuleKey *key = RedisModule_OpenKey(ctx, keyname, REDISMODULE_READ);
+  rater_window window;
+  const char *err = rater_get_window(key, &window);
+  RedisModule_CloseKey(key);
+  if (err) {
+    rater_stat.wrongtype++;
+    return RedisModule_ReplyWithError(ctx, err);
+  }
+
+  long long limited = 0, limit = 0, remaining = 0, retry_after = 0, ttl = 0;
+  int store = rater_window_limit(params, &window, options->now, quantity,
+                                 &limited, &limit, &remaining, &retry_after,
+                                 &ttl);
+
+  if (store) {
+    long long ms = ttl / NSEC_PER_MSEC + (ttl % NSEC_PER_MSEC != 0);
+    key = RedisModule_OpenKey(ctx, keyname, REDISMODULE_READ | REDISMODULE_WRITE);
+    rater_set_window(key, &window);
+    ms = rater_set_expire(key, ms);
+    RedisModule_CloseKey(key);
+#ifndef USE_MONOTONIC_CLOCK
+    RedisModule_Replicate(ctx, "RATER.WSET", "sllll", keyname, window.start,
+                          window.count, window.prev, ms);
+#endif
+  }
+
+  rater_stats_count(ctx, keyname, quantity, limited);
+  rater_reply(ctx, limited, limit, remaining, retry_after, ttl, options);
+  return REDISMODULE_OK;
+}
+
+int RaterWSet_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv,
+                           int argc) {
+  /* RATER.WSET <key> <start> <count> <prev> [<ttl>]
+   *
+   * Stores a rater-win value, as emitted by the AOF rewrite and replicated.
+   * The ttl is in milliseconds. */
+  if (argc < 5 || argc > 6) return RedisModule_WrongArity(ctx);
+
+  rater_window window;
+  long long ttl = REDISMODULE_NO_EXPIRE;
+  if (RedisModule_StringToLongLong(argv[2], &window.start) != REDISMODULE_OK ||
+      RedisModule_StringToLongLong(argv[3], &window.count) != REDISMODULE_OK ||
+      RedisModule_StringToLongLong(argv[4], &window.prev) != REDISMODULE_OK ||
+      window.count < 0 || window.prev < 0) {
+    return RedisModule_ReplyWithError(ctx, "ERR invalid window");
+  }
+  if (argc == 6 &&
+      (RedisModule_StringToLongLong(argv[5], &ttl) != REDISMODULE_OK ||
+       ttl < 0)) {
+    return RedisModule_ReplyWithError(ctx, "ERR invalid ttl");
+  }
+
+  RedisModuleKey *key =
+      RedisModule_OpenKey(ctx, argv[1], REDISMODULE_READ | REDISMODULE_WRITE);
+  if (RedisModule_KeyType(key) != REDISMODULE_KEYTYPE_EMPTY &&
+      RedisModule_ModuleTypeGetType(key) != RaterWindowType) {
+    RedisModule_CloseKey(key);
+    return RedisModule_ReplyWithError(ctx, REDISMODULE_ERRORMSG_WRONGTYPE);
+  }
+
+  rater_set_window(key, &window);
+  if (ttl != REDISMODULE_NO_EXPIRE) {
+    RedisModule_SetExpire(key, ttl);
+  }
+  RedisModule_CloseKey(key);
+
+  RedisModule_ReplicateVerbatim(ctx);
+  return RedisModule_ReplyWithSimpleString(ctx, "OK");
+}
+
+/* rater_limit_key applies quantity against the limit described by params on
+ * the key named keyname, and replies with the outcome. */
+static int rater_limit_key(RedisModuleCtx *ctx, RedisModuleString *keyname,
+                           const rater_params *params, long long quantity,
+                           const rater_options *options) {
+  int algo = options->algo >= 0 ? options->algo : params->algo;
+  if (algo != RATER_ALGO_GCRA) {
+    rater_params window = *params;
+    window.algo = algo;
+    return rater_window_key(ctx, keyname, &window, quantity, options);
+  }
+
+  long long tat = 0;
+  const char *err = rater_read_tat(ctx, keyname, &tat);
+  if (err) {
+    rater_stat.wrongtype++;
+    return RedisModule_ReplyWithError(ctx, err);
+  }
+
+  /* After all that preamble, do the Cell-Rate Limiting calculations. */
+  long long limited = 0, limit = 0, remaining = 0, retry_after = 0, ttl = 0;
+  long long new_tat =
+      rater_limit(params, tat, options->now, quantity, &limited, &limit,
+                  &remaining, &retry_after, &ttl);
+
+  /* If there is a new theoretical arrival time, store it back on the key. */
+  if (new_tat > 0) {
+    rater_write_tat(ctx, keyname, new_tat, ttl);
+  }
+
+  rater_stats_count(ctx, keyname, quantity, limited);
+  rater_reply(ctx, limited, limit, remaining, retry_after, ttl, options);
+  return REDISMODULE_OK;
+}
+
+int RaterLimit_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv,
+                            int argc) {
+  /* RATER.LIMIT <key> <burst> <count per period> <period> [<quantity>]
+   *             [UNIT s|ms|us] */
+  if (argc < 5) return RedisModule_WrongArity(ctx);
+  long long start = rater_stats_start();
+
+  /* Parse and validate the arguments, in their order. */
+  rater_params params;
+  rater_options options;
+  long long quantity;
+  const char *err = rater_parse_limit(&argv[2], &params);
+  if (!err) err = rater_parse_tail(&argv[5], argc - 5, &quantity, &options);
+
+  if (err) {
+    return rater_stats_parse_error(ctx, err);
+  }
+
+  int ret = rater_limit_key(ctx, argv[1], &params, quantity, &options);
+  rater_stats_end(start);
+  return ret;
+}
+
+int RaterPeek_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv,
+                           int argc) {
+  /* RATER.PEEK <key> <burst> <count per period> <period> [UNIT s|ms|us]
+   *
+   * The same as RATER.LIMIT with a quantity of 0, but read-only, so that it can
+   * be served by replicas. */
+  if (argc < 5) return RedisModule_WrongArity(ctx);
+  long long start = rater_stats_start();
+
+  rater_params params;
+  rater_options options;
+  const char *err = rater_parse_limit(&argv[2], &params);
+  if (!err) err = rater_parse_options(&argv[5], argc - 5, &options);
+  if (err) {
+    return rater_stats_parse_error(ctx, err);
+  }
+
+  int ret = rater_limit_key(ctx, argv[1], &params, 0, &options);
+  rater_stats_end(start);
+  return ret;
+}
+
+/* Most stripes a limit can be split into */
+#define RATER_STRIPES_MAX 1024
+
+/* rater_params_stripe turns params into those of one of stripes equal shares
+ * of the limit. Each stripe emits stripes times slower, and as its capacity is
+ * measured in time the tolerance stays, so stripes together allow exactly the
+ * rate and burst of the whole. But a stripe must allow a single unit, so when
+ * the burst is smaller than the number of stripes each is given room for one,
+ * and the stripes together burst up to stripes units. */
+static void rater_params_stripe(rater_params *params, long long stripes) {
+  params->emission_interval =
+      rater_saturate((__int128) params->emission_interval * stripes);
+  if (params->delay_variation_tolerance < params->emission_interval) {
+    params->delay_variation_tolerance = params->emission_interval;
+  }
+  /* Replies tell the limit of the stripe */
+  params->burst =
+      params->delay_variation_tolerance / params->emission_interval - 1;
+}
+
+int RaterSLimit_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv,
+                             int argc) {
+  /* RATER.SLIMIT <key> <stripes> <burst> <count per period> <period>
+   *              [<quantity>] [UNIT s|ms|us]
+   *
+   * Applies quantity to key, one of stripes keys sharing the limit evenly.
+   * Stripes named to hash to different slots spread a single limit across a
+   * cluster, as a command only ever touches its own stripe. */
+  if (argc < 6) return RedisModule_WrongArity(ctx);
+  long long start = rater_stats_start();
+
+  long long stripes;
+  rater_params params;
+  rater_options options;
+  long long quantity;
+  const char *err = NULL;
+  if (RedisModule_StringToLongLong(argv[2], &stripes) != REDISMODULE_OK ||
+      stripes <= 0 || stripes > RATER_STRIPES_MAX) {
+    err = "ERR invalid stripes";
+  }
+  if (!err) err = rater_parse_limit(&argv[3], &params);
+  if (!err) err = rater_parse_tail(&argv[6], argc - 6, &quantity, &options);
+  if (!err) err = rater_gcra_only(&options);
+  if (err) {
+    return rater_stats_parse_error(ctx, err);
+  }
+
+  rater_params_stripe(&params, stripes);
+  int ret = rater_limit_key(ctx, argv[1], &params, quantity, &options);
+  rater_stats_end(start);
+  return ret;
+}
+
+/* A single <key> <burst> <count per period> <period> <quantity> tuple of
+ * RATER.MLIMIT, along with the result of evaluating it. */
+typedef struct rater_tuple {
+  RedisModuleString *keyname;
+  rater_params params;
+  long long quantity;
+  long long tat, new_tat;
+  long long limited, limit, remaining, retry_after, ttl;
+} rater_tuple;
+
+/* rater_limit_tuples evaluates count tuples against the same clock reading
+ * now, storing the new theoretical arrival time of those that pass, or of none
+ * of them unless they all pass when all is set. Returns NULL on success or the
+ * error met on a key, and whether any tuple was limited in any_limited. */
+static const char *rater_limit_tuples(RedisModuleCtx *ctx, rater_tuple *tuples,
+                                      int count, int all, long long now,
+                                      int *any_limited) {
+  *any_limited = 0;
+  for (int i = 0; i < count; i++) {
+    rater_tuple *t = &tuples[i];
+    const char *err = rater_read_tat(ctx, t->keyname, &t->tat);
+    if (err) {
+      /* Tuples before this one may already have been applied, which is the
+       * same outcome as sending them as separate RATER.LIMIT commands. */
+      return err;
+    }
+
+    /* When all-or-nothing, nothing is stored until every tuple is known to
+     * pass, so the same key appearing twice must see the pending state. */
+    long long tat = t->tat;
+    if (all) {
+      for (int j = i - 1; j >= 0; j--) {
+        if (RedisModule_StringCompare(tuples[j].keyname, t->keyname) == 0) {
+          tat = tuples[j].new_tat > 0 ? tuples[j].new_tat : tuples[j].tat;
+          break;
+        }
+      }
+    }
+
+    t->new_tat = rater_limit(&t->params, tat, now, t->quantity, &t->limited,
+                             &t->limit, &t->remaining, &t->retry_after, &t->ttl);
+    *any_limited |= t->limited;
+
+    if (!all && t->new_tat > 0) {
+      rater_write_tat(ctx, t->keyname, t->new_tat, t->ttl);
+    }
+  }
+
+  if (all) {
+    for (int i = 0; i < count; i++) {
+      rater_tuple *t = &tuples[i];
+      if (*any_limited) {
+        /* Nothing is charged, so tuples that would have passed report the
+         * untouched state of their key, as if peeked. */
+        if (!t->limited) {
+          rater_limit(&t->params, t->tat, now, 0, &t->limited, &t->limit,
+                      &t->remaining, &t->retry_after, &t->ttl);
+        }
+      } else if (t->new_tat > 0) {
+        rater_write_tat(ctx, t->keyname, t->new_tat, t->ttl);
+      }
+    }
+  }
+  return NULL;
+}
+
+/* rater_skip_options returns the index of the first argument from i on that is
+ * neither an option nor the flag, if not NULL, which commands put before their
+ * keys. Keys named like an option can't come first. */
+static int rater_skip_options(RedisModuleString **argv, int argc, int i,
+                              const char *flag) {
+  while (i < argc) {
+    if ((flag && rater_arg_is(argv[i], flag)) ||
+        rater_arg_is(argv[i], "allowat")) {
+      i++;
+    } else if (rater_is_option(argv[i])) {
+      i += 2;
+    } else {
+      break;
+    }
+  }
+  return i < argc ? i : argc;
+}
+
+int RaterMLimit_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv,
+                             int argc) {
+  /* RATER.MLIMIT [ALL] [UNIT s|ms|us]
+   *              <key> <burst> <count per period> <period> <quantity>
+   *              [<key> <burst> <count per period> <period> <quantity> ...]
+   *
+   * Options come first, up to the first argument that isn't one. */
+  int all = 0, first = rater_skip_options(argv, argc, 1, "all");
+
+  /* Key positions depend on the options given. */
+  if (RedisModule_IsKeysPositionRequest(ctx)) {
+    for (int i = first; i + 4 < argc; i += 5) {
+      RedisModule_KeyAtPos(ctx, i);
+    }
+    return REDISMODULE_OK;
+  }
+
+  if (argc - first < 5 || (argc - first) % 5 != 0) {
+    return RedisModule_WrongArity(ctx);
+  }
+  long long start = rater_stats_start();
+
+  rater_options options = rater_default_options;
+  options.now = get_nanos();
+  for (int i = 1; i < first;) {
+    if (rater_arg_is(argv[i], "all")) {
+      all = 1;
+      i++;
+      continue;
+    }
+    const char *err = rater_parse_option(argv, first, &i, &options);
+    if (!err) err = rater_gcra_only(&options);
+    if (err) return rater_stats_parse_error(ctx, err);
+  }
+
+  /* Validate every tuple before touching any key, so that an invalid argument
+   * never leaves the batch half applied. */
+  int count = (argc - first) / 5;
+  rater_tuple *tuples = RedisModule_PoolAlloc(ctx, sizeof(*tuples) * count);
+  for (int i = 0; i < count; i++) {
+    RedisModuleString **args = &argv[first + i * 5];
+    rater_tuple *t = &tuples[i];
+    t->keyname = args[0];
+    const char *err = rater_parse_limit(&args[1], &t->params);
+    if (!err) err = rater_parse_quantity(args[4], &t->quantity);
+    if (err) return rater_stats_parse_error(ctx, err);
+  }
+
+  /* Every tuple is evaluated against the same clock reading. */
+  int any_limited;
+  const char *err = rater_limit_tuples(ctx, tuples, count, all, options.now,
+                                       &any_limited);
+  if (err) {
+    rater_stat.wrongtype++;
+    return RedisModule_ReplyWithError(ctx, err);
+  }
+
+  /* Tuples that would have passed an ALL call that was limited weren't
+   * charged, and aren't counted either. */
+  RedisModule_ReplyWithArray(ctx, count);
+  for (int i = 0; i < count; i++) {
+    rater_tuple *t = &tuples[i];
+    if (t->limited || !(all && any_limited)) {
+      rater_stats_count(ctx, t->keyname, t->quantity, t->limited);
+    }
+    rater_reply(ctx, t->limited, t->limit, t->remaining, t->retry_after,
+                t->ttl, &options);
+  }
+  rater_stats_end(start);
+  return REDISMODULE_OK;
+}
+
+int RaterHLimit_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv,
+                             int argc) {
+  /* RATER.HLIMIT [UNIT s|ms|us] <quantity>
+   *              <key> <burst> <count per period> <period>
+   *              [<key> <burst> <count per period> <period> ...]
+   *
+   * Applies quantity to a chain of nested limits, such as plan, organization
+   * and user, outermost first. Either every level passes and all are charged,
+   * or none is. The reply is that of RATER.LIMIT, except that the first item
+   * is the level that blocked the call, from 1, or 0 if it passed. The other
+   * items are those of the blocking level, or of the level with the least
+   * remaining if the call passed, but retry_after is how long until every
+   * level allows it. Options come first, up to the quantity. */
+  int first = rater_skip_options(argv, argc, 1, NULL) + 1;
+
+  if (RedisModule_IsKeysPositionRequest(ctx)) {
+    for (int i = first; i + 3 < argc; i += 4) {
+      RedisModule_KeyAtPos(ctx, i);
+    }
+    return REDISMODULE_OK;
+  }
+
+  if (argc - first < 4 || (argc - first) % 4 != 0) {
+    return RedisModule_WrongArity(ctx);
+  }
+  long long start = rater_stats_start();
+
+  rater_options options;
+  long long quantity;
+  const char *err = rater_parse_options(&argv[1], first - 2, &options);
+  if (!err) err = rater_gcra_only(&options);
+  if (!err) err = rater_parse_quantity(argv[first - 1], &quantity);
+  if (err) return rater_stats_parse_error(ctx, err);
+
+  int count = (argc - first) / 4;
+  rater_tuple *tuples = RedisModule_PoolAlloc(ctx, sizeof(*tuples) * count);
+  for (int i = 0; i < count; i++) {
+    RedisModuleString **args = &argv[first + i * 4];
+    rater_tuple *t = &tuples[i];
+    t->keyname = args[0];
+    t->quantity = quantity;
+    err = rater_parse_limit(&args[1], &t->params);
+    if (err) return rater_stats_parse_error(ctx, err);
+  }
+
+  int any_limited;
+  err = rater_limit_tuples(ctx, tuples, count, 1, options.now, &any_limited);
+  if (err) {
+    rater_stat.wrongtype++;
+    return RedisModule_ReplyWithError(ctx, err);
+  }
+
+  /* The level reported is the first limited one, outermost first, or else the
+   * closest to being limited. A single level that can never pass means the
+   * call never does. */
+  int level = -1;
+  long long retry_after = -1;
+  for (int i = 0; i < count; i++) {
+    rater_tuple *t = &tuples[i];
+    if (any_limited) {
+      if (!t->limited) continue;
+      if (level < 0) {
+        level = i;
+        retry_after = t->retry_after;
+      } else if (retry_after >= 0 &&
+                 (t->retry_after < 0 || t->retry_after > retry_after)) {
+        retry_after = t->retry_after;
+      }
+    } else if (level < 0 || t->remaining < tuples[level].remaining) {
+      level = i;
+    }
+  }
+
+  /* A limited call counts once, against the level reported, as the others
+   * weren't charged. */
+  rater_tuple *t = &tuples[level];
+  for (int i = 0; i < count; i++) {
+    if (!any_limited || i == level) {
+      rater_stats_count(ctx, tuples[i].keyname, quantity, tuples[i].limited);
+    }
+  }
+  rater_reply(ctx, any_limited ? level + 1 : 0, t->limit, t->remaining,
+              any_limited ? retry_after : -1, t->ttl, &options);
+  rater_stats_end(start);
+  return REDISMODULE_OK;
+}
+
+/* Leases let clients of a very hot key take several units at once and spend
+ * them locally, coming back only once exhausted. Units are charged when leased,
+ * so to not let them pile up into a burst on top of the limit, a lease lasts
+ * only as long as the limit takes to emit what it granted: units left by then
+ * are void, and may be given back earlier with RATER.RETURN. */
+int RaterLease_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv,
+                            int argc) {
+  /* RATER.LEASE <key> <burst> <count per period> <period> <quantity>
+   *             [UNIT s|ms|us]
+   *
+   * Grants as much of quantity as allowed right now. The reply is the one of
+   * RATER.LIMIT, limited only when nothing was granted, followed by the number
+   * of units granted and how long the lease lasts. */
+  if (argc < 6) return RedisModule_WrongArity(ctx);
+  long long start = rater_stats_start();
+
+  rater_params params;
+  rater_options options;
+  long long quantity;
+  const char *err = rater_parse_limit(&argv[2], &params);
+  if (!err) err = rater_parse_quantity(argv[5], &quantity);
+  if (!err && quantity == 0) err = "ERR invalid quantity";
+  if (!err) err = rater_parse_options(&argv[6], argc - 6, &options);
+  if (!err) err = rater_gcra_only(&options);
+  if (err) {
+    return rater_stats_parse_error(ctx, err);
+  }
+
+  long long tat = 0;
+  err = rater_read_tat(ctx, argv[1], &tat);
+  if (err) {
+    rater_stat.wrongtype++;
+    return RedisModule_ReplyWithError(ctx, err);
+  }
+
+  /* The remaining count of a peek is exactly the largest quantity allowed. */
+  long long now = options.now;
+  long long limited = 0, limit = 0, remaining = 0, retry_after = 0, ttl = 0;
+  rater_limit(&params, tat, now, 0, &limited, &limit, &remaining, &retry_after,
+              &ttl);
+  long long granted = remaining < quantity ? remaining : quantity;
+
+  /* Nothing granted is a limited call of a single unit. */
+  long long new_tat =
+      rater_limit(&params, tat, now, granted > 0 ? granted : 1, &limited,
+                  &limit, &remaining, &retry_after, &ttl);
+  if (new_tat > 0) {
+    rater_write_tat(ctx, argv[1], new_tat, ttl);
+  }
+  long long lease =
+      rater_saturate((__int128) params.emission_interval * granted);
+
+  rater_stats_count(ctx, argv[1], granted > 0 ? granted : quantity, limited);
+  rater_field extra[] = {{"granted", granted},
+                         {"lease", rater_in_unit(lease, &options)}};
+  rater_reply_extended(ctx, limited, limit, remaining, retry_after, ttl, extra,
+                       2, &options);
+  rater_stats_end(start);
+  return REDISMODULE_OK;
+}
+
+int RaterReturn_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv,
+                             int argc) {
+  /* RATER.RETURN <key> <burst> <count per period> <period> <quantity>
+   *              [UNIT s|ms|us]
+   *
+   * Gives back quantity unused units of a lease, moving the theoretical
+   * arrival time of the key back, though never before now. Replies as a peek
+   * would after that. */
+  if (argc < 6) return RedisModule_WrongArity(ctx);
+  long long start = rater_stats_start();
+
+  rater_params params;
+  rater_options options;
+  long long quantity;
+  const char *err = rater_parse_limit(&argv[2], &params);
+  if (!err) err = rater_parse_quantity(argv[5], &quantity);
+  if (!err) err = rater_parse_options(&argv[6], argc - 6, &options);
+  if (!err) err = rater_gcra_only(&options);
+  if (err) {
+    return rater_stats_parse_error(ctx, err);
+  }
+
+  long long tat = 0;
+  err = rater_read_tat(ctx, argv[1], &tat);
+  if (err) {
+    rater_stat.wrongtype++;
+    return RedisModule_ReplyWithError(ctx, err);
+  }
+
+  long long now = options.now;
+  if (tat > now && quantity > 0) {
+    tat = rater_saturate((__int128) tat -
+                         (__int128) params.emission_interval * quantity);
+    if (tat < now) tat = now;
+    rater_write_tat(ctx, argv[1], tat, tat - now);
+  }
+
+  long long limited = 0, limit = 0, remaining = 0, retry_after = 0, ttl = 0;
+  rater_limit(&params, tat, now, 0, &limited, &limit, &remaining, &retry_after,
+              &ttl);
+  rater_reply(ctx, limited, limit, remaining, retry_after, ttl, &options);
+  rater_stats_end(start);
+  return REDISMODULE_OK;
+}
+
+/* Clients blocked by RATER.WAIT are queued per key, in the order they came
+ * in, and only the first one of each queue has a timer, armed for the moment
+ * its quantity is allowed. When it fires the first waiter is served, and so are
+ * those after it that are allowed by then, before the timer is armed again for
+ * the next one. Queues are kept by db and key name, and waiters by blocked
+ * client, to find them again on timeouts and disconnections. */
+typedef struct rater_waiter rater_waiter;
+
+typedef struct rater_queue {
+  int db;
+  RedisModuleString *keyname;
+  char *entry; /* Key of the queue in rater_queues */
+  size_t len;
+  rater_waiter *head, *tail;
+  RedisModuleTimerID timer;
+  int armed;
+} rater_queue;
+
+struct rater_waiter {
+  RedisModuleBlockedClient *bc;
+  rater_queue *queue;
+  rater_waiter *prev, *next;
+  rater_params params;
+  rater_options options;
+  long long quantity;
+  /* The outcome, once served */
+  const char *err;
+  long long limited, limit, remaining, retry_after, ttl;
+};
+
+static RedisModuleDict *rater_queues;
+static RedisModuleDict *rater_waiters;
+
+static void rater_wait_fire(RedisModuleCtx *ctx, void *data);
+
+/* rater_allow_at returns when quantity is allowed against the theoretical
+ * arrival time tat, in nanoseconds. */
+static long long rater_allow_at(const rater_params *params, long long tat,
+                                long long quantity) {
+  return rater_saturate((__int128) tat +
+                        (__int128) params->emission_interval * quantity -
+                        params->delay_variation_tolerance);
+}
+
+/* rater_wait_arm arms the timer of queue for its first waiter, given the
+ * theoretical arrival time of the key as of now. */
+static void rater_wait_arm(RedisModuleCtx *ctx, rater_queue *queue,
+                           long long tat, long long now) {
+  if (queue->armed) {
+    RedisModule_StopTimer(ctx, queue->timer, NULL);
+    queue->armed = 0;
+  }
+  if (queue->head == NULL) return;
+
+  long long delay = rater_allow_at(&queue->head->params, tat,
+                                   queue->head->quantity) - now;
+  mstime_t period = delay > 0 ? (delay + NSEC_PER_MSEC - 1) / NSEC_PER_MSEC : 0;
+  queue->timer = RedisModule_CreateTimer(ctx, period, rater_wait_fire, queue);
+  queue->armed = 1;
+}
+
+static void rater_queue_free(RedisModuleCtx *ctx, rater_queue *queue) {
+  if (queue->armed) {
+    RedisModule_StopTimer(ctx, queue->timer, NULL);
+  }
+  RedisModule_DictDelC(rater_queues, queue->entry, queue->len, NULL);
+  RedisModule_FreeString(NULL, queue->keyname);
+  RedisModule_Free(queue->entry);
+  RedisModule_Free(queue);
+}
+
+/* rater_wait_remove takes waiter out of its queue, freeing the queue once
+ * empty. */
+static void rater_wait_remove(RedisModuleCtx *ctx, rater_waiter *waiter) {
+  rater_queue *queue = waiter->queue;
+  RedisModule_DictDelC(rater_waiters, &waiter->bc, sizeof(waiter->bc), NULL);
+
+  if (waiter->prev) {
+    waiter->prev->next = waiter->next;
+  } else {
+    queue->head = waiter->next;
+  }
+  if (waiter->next) {
+    waiter->next->prev = waiter->prev;
+  } else {
+    queue->tail = waiter->prev;
+  }
+
+  if (queue->head == NULL) {
+    rater_queue_free(ctx, queue);
+  } else if (waiter->prev == NULL) {
+    /* The next waiter may be allowed already, which is up to the timer to
+     * tell as keys are read from the db of the queue there. */
+    if (queue->armed) RedisModule_StopTimer(ctx, queue->timer, NULL);
+    queue->timer = RedisModule_CreateTimer(ctx, 0, rater_wait_fire, queue);
+    queue->armed = 1;
+  }
+}
+
+/* rater_wait_fire serves the waiters of a queue that are allowed by now. */
+static void rater_wait_fire(RedisModuleCtx *ctx, void *data) {
+  rater_queue *queue = data;
+  queue->armed = 0;
+  RedisModule_SelectDb(ctx, queue->db);
+
+  while (queue->head) {
+    rater_waiter *waiter = queue->head;
+    long long tat = 0, now = get_nanos();
+    waiter->options.now = now;
+    waiter->err = rater_read_tat(ctx, queue->keyname, &tat);
+    if (!waiter->err) {
+      long long new_tat =
+          rater_limit(&waiter->params, tat, now, waiter->quantity,
+                      &waiter->limited, &waiter->limit, &waiter->remaining,
+                      &waiter->retry_after, &waiter->ttl);
+      if (waiter->limited) {
+        rater_wait_arm(ctx, queue, tat, now);
+        return;
+      }
+      rater_write_tat(ctx, queue->keyname, new_tat, waiter->ttl);
+      rater_stats_count(ctx, queue->keyname, waiter->quantity, 0);
+    }
+
+    /* The queue is gone along with its last waiter */
+    int last = waiter->next == NULL;
+    RedisModuleBlockedClient *bc = waiter->bc;
+    rater_wait_remove(ctx, waiter);
+    RedisModule_UnblockClient(bc, waiter);
+    if (last) return;
+  }
+}
+
+/* Served waiters are handed to UnblockClient, after which Redis frees them
+ * with rater_wait_free, replied first unless the client disconnected in
+ * between. */
+static int rater_wait_reply(RedisModuleCtx *ctx, RedisModuleString **argv,
+                            int argc) {
+  REDISMODULE_NOT_USED(argv);
+  REDISMODULE_NOT_USED(argc);
+  rater_waiter *waiter = RedisModule_GetBlockedClientPrivateData(ctx);
+  if (waiter == NULL) return REDISMODULE_OK;
+
+  if (waiter->err) {
+    RedisModule_ReplyWithError(ctx, waiter->err);
+  } else {
+    rater_reply(ctx, waiter->limited, waiter->limit, waiter->remaining,
+                waiter->retry_after, waiter->ttl, &waiter->options);
+  }
+  return REDISMODULE_OK;
+}
+
+static void rater_wait_free(RedisModuleCtx *ctx, void *privdata) {
+  REDISMODULE_NOT_USED(ctx);
+  RedisModule_Free(privdata);
+}
+
+/* On timeout, the client is replied as limited, with the current state of the
+ * key. Redis doesn't release the blocked client once timed out, which is up to
+ * UnblockClient as on disconnections. */
+static int rater_wait_timeout(RedisModuleCtx *ctx, RedisModuleString **argv,
+                              int argc) {
+  REDISMODULE_NOT_USED(argv);
+  REDISMODULE_NOT_USED(argc);
+  RedisModuleBlockedClient *bc = RedisModule_GetBlockedClientHandle(ctx);
+  rater_waiter *waiter = RedisModule_DictGetC(rater_waiters, &bc, sizeof(bc),
+                                              NULL);
+  if (waiter == NULL) return RedisModule_ReplyWithNull(ctx);
+
+  long long tat = 0;
+  const char *err = rater_read_tat(ctx, waiter->queue->keyname, &tat);
+  if (err) {
+    rater_wait_remove(ctx, waiter);
+    RedisModule_UnblockClient(bc, NULL);
+    RedisModule_Free(waiter);
+    return RedisModule_ReplyWithError(ctx, err);
+  }
+
+  long long limited, limit, remaining, retry_after, ttl;
+  long long now = waiter->options.now = get_nanos();
+  rater_limit(&waiter->params, tat, now, 0, &limited, &limit, &remaining,
+              &retry_after, &ttl);
+  long long delay =
+      rater_allow_at(&waiter->params, tat, waiter->quantity) - now;
+  retry_after = delay > 0 ? delay : 0;
+
+  rater_stats_count(ctx, waiter->queue->keyname, waiter->quantity, 1);
+  rater_wait_remove(ctx, waiter);
+  RedisModule_UnblockClient(bc, NULL);
+  rater_reply(ctx, 1, limit, remaining, retry_after, ttl, &waiter->options);
+  RedisModule_Free(waiter);
+  return REDISMODULE_OK;
+}
+
+static void rater_wait_disconnected(RedisModuleCtx *ctx,
+                                    RedisModuleBlockedClient *bc) {
+  rater_waiter *waiter = RedisModule_DictGetC(rater_waiters, &bc, sizeof(bc),
+                                              NULL);
+  if (waiter == NULL) return;
+
+  rater_wait_remove(ctx, waiter);
+  RedisModule_Free(waiter);
+  RedisModule_UnblockClient(bc, NULL);
+}
+
+int RaterWait_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv,
+                           int argc) {
+  /* RATER.WAIT <key> <burst> <count per period> <period> <quantity> <timeout>
+   *            [UNIT s|ms|us]
+   *
+   * Like RATER.LIMIT, but when limited the client is blocked until quantity
+   * is allowed, for up to timeout milliseconds (0 to wait forever), behind the
+   * clients already waiting on the same key. */
+  if (argc < 7) return RedisModule_WrongArity(ctx);
+  long long start = rater_stats_start();
+
+  rater_params params;
+  rater_options options;
+  long long quantity, timeout;
+  const char *err = rater_parse_limit(&argv[2], &params);
+  if (!err) err = rater_parse_quantity(argv[5], &quantity);
+  if (!err && (RedisModule_StringToLongLong(argv[6], &timeout) !=
+                   REDISMODULE_OK ||
+               timeout < 0)) {
+    err = "ERR invalid timeout";
+  }
+  if (!err) err = rater_parse_options(&argv[7], argc - 7, &options);
+  if (!err) err = rater_gcra_only(&options);
+  if (!err && options.now_given) err = "ERR NOW is not supported by RATER.WAIT";
+  if (err) {
+    return rater_stats_parse_error(ctx, err);
+  }
+
+  long long tat = 0;
+  err = rater_read_tat(ctx, argv[1], &tat);
+  if (err) {
+    rater_stat.wrongtype++;
+    return RedisModule_ReplyWithError(ctx, err);
+  }
+
+  long long now = options.now;
+  long long limited = 0, limit = 0, remaining = 0, retry_after = 0, ttl = 0;
+  long long new_tat = rater_limit(&params, tat, now, quantity, &limited,
+                                  &limit, &remaining, &retry_after, &ttl);
+
+  size_t len;
+  char *entry = rater_db_entry(ctx, argv[1], &len);
+  rater_queue *queue = RedisModule_DictGetC(rater_queues, entry, len, NULL);
+
+  /* Clients can't block within MULTI or scripts, and waiting is pointless for
+   * a quantity that is never allowed (retry_after is -1) or for peeks, so all
+   * of those get the same reply as RATER.LIMIT. */
+  int flags = RedisModule_GetContextFlags(ctx);
+  int blocking = !(flags & (REDISMODULE_CTX_FLAGS_MULTI |
+                            REDISMODULE_CTX_FLAGS_LUA |
+                            REDISMODULE_CTX_FLAGS_DENY_BLOCKING));
+  if ((queue == NULL && !limited) || !blocking || quantity == 0 ||
+      (limited && retry_after == -1)) {
+    if (new_tat > 0) {
+      rater_write_tat(ctx, argv[1], new_tat, ttl);
+    }
+    rater_stats_count(ctx, argv[1], quantity, limited);
+    rater_reply(ctx, limited, limit, remaining, retry_after, ttl, &options);
+    rater_stats_end(start);
+    return REDISMODULE_OK;
+  }
+
+  RedisModuleBlockedClient *bc = RedisModule_BlockClient(
+      ctx, rater_wait_reply, rater_wait_timeout, rater_wait_free, timeout);
+  RedisModule_SetDisconnectCallback(bc, rater_wait_disconnected);
+
+  if (queue == NULL) {
+    queue = RedisModule_Calloc(1, sizeof(*queue));
+    queue->db = RedisModule_GetSelectedDb(ctx);
+    queue->keyname = RedisModule_CreateStringFromString(NULL, argv[1]);
+    queue->entry = RedisModule_Alloc(len);
+    memcpy(queue->entry, entry, len);
+    queue->len = len;
+    RedisModule_DictSetC(rater_queues, queue->entry, len, queue);
+  }
+
+  rater_waiter *waiter = RedisModule_Calloc(1, sizeof(*waiter));
+  waiter->bc = bc;
+  waiter->queue = queue;
+  waiter->params = params;
+  waiter->options = options;
+  waiter->quantity = quantity;
+  waiter->prev = queue->tail;
+  if (queue->tail) {
+    queue->tail->next = waiter;
+  } else {
+    queue->head = waiter;
+  }
+  queue->tail = waiter;
+  RedisModule_DictSetC(rater_waiters, &bc, sizeof(bc), waiter);
+
+  if (queue->head == waiter) {
+    rater_wait_arm(ctx, queue, tat, now);
+  }
+  rater_stats_end(start);
+  return REDISMODULE_OK;
+}
+
+/* Policies are limits registered once with RATER.POLICY SET and referenced by
+ * name from RATER.APPLY, which saves sending and parsing them on every call.
+ * They are kept in a dict of rater_policy by name, saved as aux data of the
+ * rater-tat type and replicated verbatim. */
+static RedisModuleDict *rater_policies;
+
+typedef struct rater_policy {
+  rater_params params; /* As registered, unscaled */
+  long long unit;      /* Of replies unless UNIT is given */
+  double scale;
+  unsigned long long epoch; /* Of the factors scaled was computed with */
+  rater_params scaled;
+} rater_policy;
+
+/* rater_policy_set registers or replaces the policy called name, which keeps
+ * its scale if replaced. */
+static void rater_policy_set(RedisModuleString *name,
+                             const rater_params *params, long long unit) {
+  rater_policy *policy = RedisModule_DictGet(rater_policies, name, NULL);
+  if (policy == NULL) {
+    policy = RedisModule_Alloc(sizeof(*policy));
+    policy->scale = 1;
+    RedisModule_DictSet(rater_policies, name, policy);
+  }
+  policy->params = *params;
+  policy->unit = unit;
+  policy->epoch = rater_scale_epoch;
+  policy->scaled = *params;
+  rater_params_scale(&policy->scaled, policy->scale * rater_scale_factor);
+}
+
+/* rater_policy_params returns the params of policy, scaled by both its own
+ * and the global factors. */
+static const rater_params *rater_policy_params(rater_policy *policy) {
+  if (policy->epoch != rater_scale_epoch) {
+    policy->epoch = rater_scale_epoch;
+    policy->scaled = policy->params;
+    rater_params_scale(&policy->scaled, policy->scale * rater_scale_factor);
+  }
+  return &policy->scaled;
+}
+
+/* rater_policy_clear removes every policy. */
+static void rater_policy_clear(void) {
+  RedisModuleDictIter *iter =
+      RedisModule_DictIteratorStartC(rater_policies, "^", NULL, 0);
+  rater_policy *policy;
+  while (RedisModule_DictNextC(iter, NULL, (void **) &policy) != NULL) {
+    RedisModule_Free(policy);
+  }
+  RedisModule_DictIteratorStop(iter);
+  RedisModule_FreeDict(NULL, rater_policies);
+  rater_policies = RedisModule_CreateDict(NULL);
+  rater_scale_factor = 1;
+  rater_scale_epoch++;
+}
+
+/* Policies are saved with a version of their own, ahead of them, so that their
+ * format and that of rater-tat values can change apart. */
+#define RATER_POLICY_AUXVER 0
+
+static void rater_type_aux_save(RedisModuleIO *rdb, int when) {
+  REDISMODULE_NOT_USED(when);
+  RedisModule_SaveUnsigned(rdb, RATER_POLICY_AUXVER);
+  RedisModule_SaveUnsigned(rdb, RedisModule_DictSize(rater_policies));
+
+  RedisModuleDictIter *iter =
+      RedisModule_DictIteratorStartC(rater_policies, "^", NULL, 0);
+  char *name;
+  size_t len;
+  rater_policy *policy;
+  while ((name = RedisModule_DictNextC(iter, &len, (void **) &policy))) {
+    RedisModule_SaveStringBuffer(rdb, name, len);
+    RedisModule_SaveSigned(rdb, policy->params.burst);
+    RedisModule_SaveSigned(rdb, policy->params.count_per_period);
+    RedisModule_SaveSigned(rdb, policy->params.period_in_sec);
+    RedisModule_SaveSigned(rdb, policy->params.algo);
+    RedisModule_SaveDouble(rdb, policy->scale);
+    RedisModule_SaveSigned(rdb, policy->unit);
+  }
+  RedisModule_DictIteratorStop(iter);
+  RedisModule_SaveDouble(rdb, rater_scale_factor);
+}
+
+static int rater_type_aux_load(RedisModuleIO *rdb, int encver, int when) {
+  REDISMODULE_NOT_USED(when);
+  REDISMODULE_NOT_USED(encver);
+  uint64_t version = RedisModule_LoadUnsigned(rdb);
+  if (version != RATER_POLICY_AUXVER) {
+    RedisModule_LogIOError(rdb, "warning",
+                           "Can't load rater policies with version %llu",
+                           (unsigned long long) version);
+    return REDISMODULE_ERR;
+  }
+
+  rater_policy_clear();
+  uint64_t count = RedisModule_LoadUnsigned(rdb);
+  for (uint64_t i = 0; i < count; i++) {
+    RedisModuleString *name = RedisModule_LoadString(rdb);
+    long long burst = RedisModule_LoadSigned(rdb);
+    long long count_per_period = RedisModule_LoadSigned(rdb);
+    long long period_in_sec = RedisModule_LoadSigned(rdb);
+    long long algo = RedisModule_LoadSigned(rdb);
+    double scale = RedisModule_LoadDouble(rdb);
+    long long unit = RedisModule_LoadSigned(rdb);
+    if (algo < RATER_ALGO_GCRA || algo > RATER_ALGO_SLIDING) {
+      RedisModule_LogIOError(rdb, "warning", "Invalid rater policy algo");
+      RedisModule_FreeString(NULL, name);
+      return REDISMODULE_ERR;
+    }
+    if (rater_unit_name(unit) == NULL) {
+      RedisModule_LogIOError(rdb, "warning", "Invalid rater policy unit");
+      RedisModule_FreeString(NULL, name);
+      return REDISMODULE_ERR;
+    }
+    if (rater_check_limit(burst, count_per_period, period_in_sec) ||
+        !(scale > 0 && scale <= RATER_SCALE_MAX)) {
+      RedisModule_LogIOError(rdb, "warning", "Invalid rater policy limit");
+      RedisModule_FreeString(NULL, name);
+      return REDISMODULE_ERR;
+    }
+
+    rater_params params;
+    rater_params_init(&params, burst, count_per_period, period_in_sec);
+    params.algo = algo;
+    rater_policy_set(name, &params, unit);
+    rater_policy *policy = RedisModule_DictGet(rater_policies, name, NULL);
+    policy->scale = scale;
+    RedisModule_FreeString(NULL, name);
+  }
+  double scale = RedisModule_LoadDouble(rdb);
+  if (!(scale > 0 && scale <= RATER_SCALE_MAX)) {
+    RedisModule_LogIOError(rdb, "warning", "Invalid rater scale factor");
+    return REDISMODULE_ERR;
+  }
+  rater_scale_factor = scale;
+  rater_scale_epoch++;
+  return REDISMODULE_OK;
+}
+
+/* rater_deny_write refuses a change of policies or factors on a read only
+ * replica or when out of memory, as Redis does for write and deny-oom
+ * commands, unless it comes from the primary or the AOF. RATER.POLICY and
+ * RATER.SCALE have neither flag, for replicas to serve their reads. Returns 1
+ * after replying. */
+static int rater_deny_write(RedisModuleCtx *ctx) {
+  int flags = RedisModule_GetContextFlags(ctx);
+  if (flags &
+      (REDISMODULE_CTX_FLAGS_REPLICATED | REDISMODULE_CTX_FLAGS_LOADING)) {
+    return 0;
+  }
+  if ((flags & REDISMODULE_CTX_FLAGS_SLAVE) &&
+      (flags & REDISMODULE_CTX_FLAGS_READONLY)) {
+    RedisModule_ReplyWithError(
+        ctx, "READONLY You can't write against a read only replica.");
+    return 1;
+  }
+  if (flags & REDISMODULE_CTX_FLAGS_OOM) {
+    RedisModule_ReplyWithError(
+        ctx, "OOM command not allowed when used memory > 'maxmemory'.");
+    return 1;
+  }
+  return 0;
+}
+
+int RaterPolicy_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv,
+                             int argc) {
+  /* RATER.POLICY SET <name> <burst> <count per period> <period>
+   *                  [ALGO gcra|fixed|sliding] [UNIT s|ms|us]
+   * RATER.POLICY GET <name>
+   * RATER.POLICY DEL <name>
+   * RATER.POLICY LIST */
+  if (argc < 2) return RedisModule_WrongArity(ctx);
+
+  if (rater_arg_is(argv[1], "set")) {
+    if (argc < 6 || argc % 2 != 0) return RedisModule_WrongArity(ctx);
+    if (rater_deny_write(ctx)) return REDISMODULE_OK;
+    long long burst = 0, count_per_period = 0, period_in_sec = 0;
+    const char *err = rater_parse_limit_args(&argv[3], &burst,
+                                             &count_per_period, &period_in_sec);
+    rater_params params;
+    if (!err) {
+      rater_params_init(&params, burst, count_per_period, period_in_sec);
+    }
+    long long unit = NSEC_PER_SEC;
+    for (int i = 6; !err && i < argc; i += 2) {
+      if (rater_arg_is(argv[i], "algo")) {
+        err = rater_parse_algo(argv[i + 1], &params.algo);
+      } else if (rater_arg_is(argv[i], "unit")) {
+        err = rater_parse_unit(argv[i + 1], &unit);
+      } else {
+        err = "ERR syntax error";
+      }
+    }
+    if (err) return RedisModule_ReplyWithError(ctx, err);
+
+    rater_policy_set(argv[2], &params, unit);
+    RedisModule_ReplicateVerbatim(ctx);
+    return RedisModule_ReplyWithSimpleString(ctx, "OK");
+  }
+
+  if (rater_arg_is(argv[1], "get")) {
+    if (argc != 3) return RedisModule_WrongArity(ctx);
+    rater_policy *policy = RedisModule_DictGet(rater_policies, argv[2], NULL);
+    if (policy == NULL) return RedisModule_ReplyWithNull(ctx);
+
+    RedisModule_ReplyWithArray(ctx, 5);
+    RedisModule_ReplyWithLongLong(ctx, policy->params.burst);
+    RedisModule_ReplyWithLongLong(ctx, policy->params.count_per_period);
+    RedisModule_ReplyWithLongLong(ctx, policy->params.period_in_sec);
+    RedisModule_ReplyWithSimpleString(ctx,
+                                      rater_algo_names[policy->params.algo]);
+    RedisModule_ReplyWithSimpleString(ctx, rater_unit_name(policy->unit));
+    return REDISMODULE_OK;
+  }
+
+  if (rater_arg_is(argv[1], "del")) {
+    if (argc != 3) return RedisModule_WrongArity(ctx);
+    if (rater_deny_write(ctx)) return REDISMODULE_OK;
+    rater_policy *policy;
+    if (RedisModule_DictDel(rater_policies, argv[2], &policy) !=
+        REDISMODULE_OK) {
+      return RedisModule_ReplyWithLongLong(ctx, 0);
+    }
+    RedisModule_Free(policy);
+    RedisModule_ReplicateVerbatim(ctx);
+    return RedisModule_ReplyWithLongLong(ctx, 1);
+  }
+
+  if (rater_arg_is(argv[1], "list")) {
+    if (argc != 2) return RedisModule_WrongArity(ctx);
+    RedisModule_ReplyWithArray(ctx, RedisModule_DictSize(rater_policies));
+    RedisModuleDictIter *iter =
+        RedisModule_DictIteratorStartC(rater_policies, "^", NULL, 0);
+    char *name;
+    size_t len;
+    while ((name = RedisModule_DictNextC(iter, &len, NULL))) {
+      RedisModule_ReplyWithStringBuffer(ctx, name, len);
+    }
+    RedisModule_DictIteratorStop(iter);
+    return REDISMODULE_OK;
+  }
+
+  return RedisModule_ReplyWithError(ctx, "ERR unknown RATER.POLICY subcommand");
+}
+
+int RaterApply_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv,
+                            int argc) {
+  /* RATER.APPLY <policy> <key> [<quantity>] [UNIT s|ms|us] */
+  if (argc < 3) return RedisModule_WrongArity(ctx);
+  long long start = rater_stats_start();
+
+  rater_policy *policy = RedisModule_DictGet(rater_policies, argv[1], NULL);
+  if (policy == NULL) {
+    return rater_stats_parse_error(ctx, "ERR unknown policy");
+  }
+
+  rater_options options;
+  long long quantity;
+  const char *err = rater_parse_tail(&argv[3], argc - 3, &quantity, &options);
+  if (err) return rater_stats_parse_error(ctx, err);
+  if (!options.unit_given) options.unit = policy->unit;
+
+  int ret = rater_limit_key(ctx, argv[2], rater_policy_params(policy),
+                            quantity, &options);
+  rater_stats_end(start);
+  return ret;
+}
+
+int RaterScale_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv,
+                            int argc) {
+  /* RATER.SCALE <policy|*> [<factor>|OVERLOAD|RECOVER]
+   *
+   * Replies with the factor of the policy, or the global one for *, after
+   * setting it or adjusting it for the feedback given. */
+  if (argc < 2 || argc > 3) return RedisModule_WrongArity(ctx);
+
+  double *scale = &rater_scale_factor;
+  if (!rater_arg_is(argv[1], "*")) {
+    rater_policy *policy = RedisModule_DictGet(rater_policies, argv[1], NULL);
+    if (policy == NULL) {
+      return RedisModule_ReplyWithError(ctx, "ERR unknown policy");
+    }
+    scale = &policy->scale;
+  }
+  if (argc == 2) return RedisModule_ReplyWithDouble(ctx, *scale);
+  if (rater_deny_write(ctx)) return REDISMODULE_OK;
+
+  /* Feedback never moves a factor the other way, even if it was set outside
+   * the bounds feedback keeps to. */
+  double factor = 0;
+  if (rater_arg_is(argv[2], "overload")) {
+    factor = *scale / rater_scale_decrease;
+    if (factor < rater_scale_min) factor = rater_scale_min;
+    if (factor > *scale) factor = *scale;
+  } else if (rater_arg_is(argv[2], "recover")) {
+    factor = *scale + rater_scale_increase;
+    if (factor > 1) factor = 1;
+    if (factor < *scale) factor = *scale;
+  } else if (RedisModule_StringToDouble(argv[2], &factor) != REDISMODULE_OK ||
+             !(factor > 0 && factor <= RATER_SCALE_MAX)) {
+    return RedisModule_ReplyWithError(ctx, "ERR invalid factor");
+  }
+
+  /* Replicas are sent the resulting factor, which feedback depends on. */
+  if (factor != *scale) {
+    *scale = factor;
+    rater_scale_epoch++;
+
+    char buf[32];
+    snprintf(buf, sizeof(buf), "%.17g", factor);
+    RedisModule_Replicate(ctx, "RATER.SCALE", "sc", argv[1], buf);
+  }
+  return RedisModule_ReplyWithDouble(ctx, factor);
+}
+
+int RaterSet_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv,
+                          int argc) {
+  /* RATER.SET <key> <tat> [<ttl>]
+   *
+   * Stores a rater-tat value, as emitted by the AOF rewrite and replicated for
+   * native keys. The ttl is in milliseconds. */
+  if (argc < 3 || argc > 4) return RedisModule_WrongArity(ctx);
+
+  long long tat = 0, ttl = REDISMODULE_NO_EXPIRE;
+  if (RedisModule_StringToLongLong(argv[2], &tat) != REDISMODULE_OK ||
+      tat <= 0) {
+    return RedisModule_ReplyWithError(ctx, "ERR invalid tat");
+  }
+  if (argc == 4 &&
+      (RedisModule_StringToLongLong(argv[3], &ttl) != REDISMODULE_OK ||
+       ttl < 0)) {
+    return RedisModule_ReplyWithError(ctx, "ERR invalid ttl");
+  }
+
+  RedisModuleKey *key =
+      RedisModule_OpenKey(ctx, argv[1], REDISMODULE_READ | REDISMODULE_WRITE);
+  if (!rater_is_rater_key(key)) {
+    RedisModule_CloseKey(key);
+    return RedisModule_ReplyWithError(ctx, REDISMODULE_ERRORMSG_WRONGTYPE);
+  }
+
+  rater_set_native(key, tat);
+  if (ttl != REDISMODULE_NO_EXPIRE) {
+    RedisModule_SetExpire(key, ttl);
+  }
+  RedisModule_CloseKey(key);
+
+  RedisModule_ReplicateVerbatim(ctx);
+  return RedisModule_ReplyWithSimpleString(ctx, "OK");
+}
+
+int RaterSync_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv,
+                           int argc) {
+  /* RATER.SYNC <key> <state>
+   *
+   * Applies the state of a key as replicated with "REPLICATION compact": its
+   * theoretical arrival time and absolute expire in milliseconds, as 64-bit
+   * little-endian integers. The key keeps its type, or follows the storage
+   * setting when it is created, and expires right away if already due. */
+  if (argc != 3) return RedisModule_WrongArity(ctx);
+
+  size_t len;
+  const char *state = RedisModule_StringPtrLen(argv[2], &len);
+  long long tat = len == RATER_SYNC_STATE_LEN ? rater_get_int64(state) : 0;
+  if (tat <= 0) {
+    return RedisModule_ReplyWithError(ctx, "ERR invalid state");
+  }
+  long long expire_at = rater_get_int64(state + 8);
+
+  RedisModuleKey *key =
+      RedisModule_OpenKey(ctx, argv[1], REDISMODULE_READ | REDISMODULE_WRITE);
+  if (!rater_is_rater_key(key)) {
+    RedisModule_CloseKey(key);
+    return RedisModule_ReplyWithError(ctx, REDISMODULE_ERRORMSG_WRONGTYPE);
+  }
+
+  long long now = RedisModule_Milliseconds();
+  if (expire_at == REDISMODULE_NO_EXPIRE) {
+    rater_store_tat(key, tat);
+    RedisModule_SetExpire(key, REDISMODULE_NO_EXPIRE);
+  } else if (expire_at > now) {
+    rater_store_tat(key, tat);
+    RedisModule_SetExpire(key, expire_at - now);
+  } else {
+    RedisModule_DeleteKey(key);
+  }
+  RedisModule_CloseKey(key);
+
+  RedisModule_ReplicateVerbatim(ctx);
+  return RedisModule_ReplyWithSimpleString(ctx, "OK");
+}
+
+/* Tables hold many limits in a single key of the rater-tbl type, for limits
+ * that are too many to afford a key each, like one per IP address. A member
+ * of a table takes 16 bytes, its hash and theoretical arrival time, instead of
+ * a whole key with its expire.
+ *
+ * Slots are grouped in buckets of a cache line and looked up by open
+ * addressing over RATER_TABLE_PROBE buckets. Members never expire by
+ * themselves: a member whose theoretical arrival time has passed is as good as
+ * a new one, so its slot is free to be taken over. When no slot is free, the
+ * member closest to being free is evicted. Slots never go back to empty, so a
+ * lookup can stop at the first empty one.
+ *
+ * Members are hashed with a random seed, chosen when the table is created and
+ * kept with it, so that collisions can't be crafted. Two members colliding
+ * share the same limit. */
+static RedisModuleType *RaterTableType;
+
+#define RATER_TABLE_ENCVER 0
+#define RATER_TABLE_SLOTS 4
+#define RATER_TABLE_PROBE 4
+/* Tables are allocated at once, so capacity is capped to keep a single
+ * CREATE from exhausting memory: 1 << 24 members take 512 MB. */
+#define RATER_TABLE_MAX_CAPACITY (1LL << 24)
+/* INFO estimates live members from up to this many buckets */
+#define RATER_TABLE_INFO_SAMPLE 1024
+
+typedef struct rater_table_slot {
+  uint64_t hash; /* 0 for an empty slot */
+  long long tat;
+} rater_table_slot;
+
+typedef struct rater_table_bucket {
+  rater_table_slot slots[RATER_TABLE_SLOTS];
+} __attribute__((aligned(64))) rater_table_bucket;
+
+typedef struct rater_table {
+  uint64_t seed;
+  long long capacity;
+  uint64_t mask;
+  long long used, evictions;
+  void *alloc;
+  rater_table_bucket *buckets;
+} rater_table;
+
+/* rater_table_create sizes a table for capacity members, at a load of 75%. */
+static rater_table *rater_table_create(long long capacity, uint64_t seed) {
+  uint64_t buckets = 1;
+  while (buckets * RATER_TABLE_SLOTS * 3 < (uint64_t) capacity * 4) {
+    buckets <<= 1;
+  }
+
+  rater_table *table = RedisModule_Alloc(sizeof(*table));
+  table->seed = seed;
+  table->capacity = capacity;
+  table->mask = buckets - 1;
+  table->used = table->evictions = 0;
+  table->alloc = RedisModule_Calloc(1, buckets * sizeof(rater_table_bucket) +
+                                           sizeof(rater_table_bucket) - 1);
+  table->buckets = (rater_table_bucket *) (((uintptr_t) table->alloc +
+                                            sizeof(rater_table_bucket) - 1) &
+                                           ~(sizeof(rater_table_bucket) - 1));
+  return table;
+}
+
+static uint64_t rater_table_hash(const rater_table *table,
+                                 RedisModuleString *member) {
+  size_t len;
+  const char *buf = RedisModule_StringPtrLen(member, &len);
+  uint64_t hash = rater_hash(buf, len, table->seed);
+  return hash ? hash : 1;
+}
+
+/* rater_table_find returns the slot of hash, if found, or else the slot where
+ * it would be stored as of now: an empty one, one free to take over, or the
+ * one to evict. */
+static rater_table_slot *rater_table_find(rater_table *table, uint64_t hash,
+                                          long long now, int *found) {
+  rater_table_slot *victim = NULL;
+  for (int i = 0; i < RATER_TABLE_PROBE; i++) {
+    rater_table_bucket *bucket = &table->buckets[(hash + i) & table->mask];
+    for (int j = 0; j < RATER_TABLE_SLOTS; j++) {
+      rater_table_slot *slot = &bucket->slots[j];
+      if (slot->hash == hash) {
+        *found = 1;
+        return slot;
+      }
+      if (slot->hash == 0) {
+        *found = 0;
+        return victim && victim->tat <= now ? victim : slot;
+      }
+      if (victim == NULL || slot->tat < victim->tat) {
+        victim = slot;
+      }
+    }
+  }
+  *found = 0;
+  return victim;
+}
+
+/* rater_table_store stores tat on slot, as the state of hash. */
+static void rater_table_store(rater_table *table, rater_table_slot *slot,
+                              uint64_t hash, long long tat, long long now) {
+  if (slot->hash == 0) {
+    table->used++;
+  } else if (slot->hash != hash && slot->tat > now) {
+    table->evictions++;
+  }
+  slot->hash = hash;
+  slot->tat = tat;
+}
+
+static void *rater_table_rdb_load(RedisModuleIO *rdb, int encver) {
+  if (encver != RATER_TABLE_ENCVER) {
+    RedisModule_LogIOError(rdb, "warning",
+                           "Can't load rater-tbl with encver %d", encver);
+    return NULL;
+  }
+  uint64_t seed = RedisModule_LoadUnsigned(rdb);
+  long long capacity = RedisModule_LoadSigned(rdb);
+  if (capacity <= 0 || capacity > RATER_TABLE_MAX_CAPACITY) {
+    RedisModule_LogIOError(rdb, "warning", "Invalid rater-tbl capacity %lld",
+                           capacity);
+    return NULL;
+  }
+  rater_table *table = rater_table_create(capacity, seed);
+
+  long long now = get_nanos();
+  uint64_t count = RedisModule_LoadUnsigned(rdb);
+  for (uint64_t i = 0; i < count; i++) {
+    uint64_t hash = RedisModule_LoadUnsigned(rdb);
+    long long tat = RedisModule_LoadSigned(rdb);
+    int found;
+    rater_table_slot *slot = rater_table_find(table, hash, now, &found);
+    rater_table_store(table, slot, hash, tat, now);
+  }
+  return table;
+}
+
+/* Members whose theoretical arrival time has passed are not saved. */
+static void rater_table_rdb_save(RedisModuleIO *rdb, void *ptr) {
+  rater_table *table = ptr;
+  long long now = get_nanos();
+  uint64_t count = 0;
+  for (uint64_t i = 0; i <= table->mask; i++) {
+    for (int j = 0; j < RATER_TABLE_SLOTS; j++) {
+      count += table->buckets[i].slots[j].tat > now;
+    }
+  }
+
+  RedisModule_SaveUnsigned(rdb, table->seed);
+  RedisModule_SaveSigned(rdb, table->capacity);
+  RedisModule_SaveUnsigned(rdb, count);
+  for (uint64_t i = 0; i <= table->mask; i++) {
+    for (int j = 0; j < RATER_TABLE_SLOTS; j++) {
+      rater_table_slot *slot = &table->buckets[i].slots[j];
+      if (slot->tat > now) {
+        RedisModule_SaveUnsigned(rdb, slot->hash);
+        RedisModule_SaveSigned(rdb, slot->tat);
+      }
+    }
+  }
+}
+
+static void rater_table_aof_rewrite(RedisModuleIO *aof, RedisModuleString *key,
+                                    void *ptr) {
+  rater_table *table = ptr;
+  long long now = get_nanos();
+  RedisModule_EmitAOF(aof, "RATER.TABLE", "csll", "CREATE", key,
+                      table->capacity, (long long) table->seed);
+  for (uint64_t i = 0; i <= table->mask; i++) {
+    for (int j = 0; j < RATER_TABLE_SLOTS; j++) {
+      rater_table_slot *slot = &table->buckets[i].slots[j];
+      if (slot->tat > now) {
+        RedisModule_EmitAOF(aof, "RATER.TABLE", "csll", "SYNC", key,
+                            (long long) slot->hash, slot->tat);
+      }
+    }
+  }
+}
+
+static size_t rater_table_mem_usage(const void *ptr) {
+  const rater_table *table = ptr;
+  return sizeof(*table) + (table->mask + 2) * sizeof(rater_table_bucket);
+}
+
+static void rater_table_digest(RedisModuleDigest *md, void *ptr) {
+  rater_table *table = ptr;
+  long long now = get_nanos();
+  for (uint64_t i = 0; i <= table->mask; i++) {
+    for (int j = 0; j < RATER_TABLE_SLOTS; j++) {
+      rater_table_slot *slot = &table->buckets[i].slots[j];
+      if (slot->tat > now) {
+        RedisModule_DigestAddLongLong(md, slot->hash);
+        RedisModule_DigestAddLongLong(md, slot->tat);
+      }
+    }
+  }
+  RedisModule_DigestEndSequence(md);
+}
+
+static void rater_table_free(void *ptr) {
+  rater_table *table = ptr;
+  RedisModule_Free(table->alloc);
+  RedisModule_Free(table);
+}
+
+/* rater_get_table returns the table stored on key, or sets err. */
+static rater_table *rater_get_table(RedisModuleKey *key, const char **err) {
+  if (RedisModule_KeyType(key) == REDISMODULE_KEYTYPE_EMPTY) {
+    *err = "ERR no such table";
+    return NULL;
+  }
+  if (RedisModule_ModuleTypeGetType(key) != RaterTableType) {
+    *err = REDISMODULE_ERRORMSG_WRONGTYPE;
+    return NULL;
+  }
+  return RedisModule_ModuleTypeGetValue(key);
+}
+
+/* rater_table_sync replicates the new state of a member by its hash, which is
+ * the same on replicas as they get the seed along with the table. */
+static void rater_table_sync(RedisModuleCtx *ctx, RedisModuleString *keyname,
+                             uint64_t hash, long long tat) {
+#ifndef USE_MONOTONIC_CLOCK
+  RedisModule_Replicate(ctx, "RATER.TABLE", "csll", "SYNC", keyname,
+                        (long long) hash, tat);
+#else
+  REDISMODULE_NOT_USED(ctx);
+  REDISMODULE_NOT_USED(keyname);
+  REDISMODULE_NOT_USED(hash);
+  REDISMODULE_NOT_USED(tat);
+#endif
+}
+
+int RaterTLimit_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv,
+                             int argc) {
+  /* RATER.TLIMIT <table> <member> <burst> <count per period> <period>
+   *              [<quantity>] [UNIT s|ms|us] */
+  if (argc < 6) return RedisModule_WrongArity(ctx);
+  long long start = rater_stats_start();
+
+  rater_params params;
+  rater_options options;
+  long long quantity;
+  const char *err = rater_parse_limit(&argv[3], &params);
+  if (!err) err = rater_parse_tail(&argv[6], argc - 6, &quantity, &options);
+  if (!err) err = rater_gcra_only(&options);
+
+  if (err) {
+    return rater_stats_parse_error(ctx, err);
+  }
+
+  RedisModuleKey *key = RedisModule_OpenKey(ctx, argv[1], REDISMODULE_READ);
+  rater_table *table = rater_get_table(key, &err);
+  RedisModule_CloseKey(key);
+  if (table == NULL) {
+    rater_stat.wrongtype++;
+    return RedisModule_ReplyWithError(ctx, err);
+  }
+
+  long long now = options.now;
+  uint64_t hash = rater_table_hash(table, argv[2]);
+  int found;
+  rater_table_slot *slot = rater_table_find(table, hash, now, &found);
+
+  long long limited = 0, limit = 0, remaining = 0, retry_after = 0, ttl = 0;
+  long long new_tat =
+      rater_limit(&params, found ? slot->tat : 0, now, quantity, &limited,
+                  &limit, &remaining, &retry_after, &ttl);
+
+  /* Reopening the table for writing signals it as modified */
+  if (new_tat > 0) {
+    key = RedisModule_OpenKey(ctx, argv[1], REDISMODULE_READ | REDISMODULE_WRITE);
+    rater_table_store(table, slot, hash, new_tat, now);
+    RedisModule_CloseKey(key);
+    rater_table_sync(ctx, argv[1], hash, new_tat);
+  }
+
+  rater_stats_count(ctx, argv[2], quantity, limited);
+  rater_reply(ctx, limited, limit, remaining, retry_after, ttl, &options);
+  rater_stats_end(start);
+  return REDISMODULE_OK;
+}
+
+int RaterTable_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv,
+                            int argc) {
+  /* RATER.TABLE CREATE <table> <capacity> [<seed>]
+   * RATER.TABLE INFO <table>
+   * RATER.TABLE SYNC <table> <hash> <tat> */
+  if (argc < 3) return RedisModule_WrongArity(ctx);
+
+  if (rater_arg_is(argv[1], "create")) {
+    if (argc < 4 || argc > 5) return RedisModule_WrongArity(ctx);
+    long long capacity, seed = 0;
+    if (RedisModule_StringToLongLong(argv[3], &capacity) != REDISMODULE_OK ||
+        capacity <= 0 || capacity > RATER_TABLE_MAX_CAPACITY) {
+      return RedisModule_ReplyWithError(ctx, "ERR invalid capacity");
+    }
+    if (argc == 5) {
+      if (RedisModule_StringToLongLong(argv[4], &seed) != REDISMODULE_OK) {
+        return RedisModule_ReplyWithError(ctx, "ERR invalid seed");
+      }
+    } else {
+      seed = (long long) rater_hash((const char *) &capacity, sizeof(capacity),
+                                    get_nanos() ^ (uintptr_t) argv);
+    }
+
+    RedisModuleKey *key =
+        RedisModule_OpenKey(ctx, argv[2], REDISMODULE_READ | REDISMODULE_WRITE);
+    if (RedisModule_KeyType(key) != REDISMODULE_KEYTYPE_EMPTY) {
+      RedisModule_CloseKey(key);
+      return RedisModule_ReplyWithError(ctx, "ERR table already exists");
+    }
+    RedisModule_ModuleTypeSetValue(key, RaterTableType,
+                                   rater_table_create(capacity, seed));
+    RedisModule_CloseKey(key);
+
+    /* Replicas must use the same seed */
+    RedisModule_Replicate(ctx, "RATER.TABLE", "csll", "CREATE", argv[2],
+                          capacity, seed);
+    return RedisModule_ReplyWithSimpleString(ctx, "OK");
+  }
+
+  if (rater_arg_is(argv[1], "info")) {
+    if (argc != 3) return RedisModule_WrongArity(ctx);
+    const char *err;
+    RedisModuleKey *key = RedisModule_OpenKey(ctx, argv[2], REDISMODULE_READ);
+    rater_table *table = rater_get_table(key, &err);
+    RedisModule_CloseKey(key);
+    if (table == NULL) return RedisModule_ReplyWithError(ctx, err);
+
+    /* Members are spread evenly by their hash, so large tables are sampled
+     * rather than scanned. used is counted as slots fill. */
+    long long now = get_nanos(), live = 0;
+    uint64_t buckets = table->mask + 1;
+    uint64_t step = buckets > RATER_TABLE_INFO_SAMPLE
+                        ? buckets / RATER_TABLE_INFO_SAMPLE
+                        : 1;
+    uint64_t sampled = 0;
+    for (uint64_t i = 0; i < buckets; i += step, sampled++) {
+      for (int j = 0; j < RATER_TABLE_SLOTS; j++) {
+        live += table->buckets[i].slots[j].tat > now;
+      }
+    }
+    live = (long long) ((__int128) live * buckets / sampled);
+
+    RedisModule_ReplyWithArray(ctx, 10);
+    RedisModule_ReplyWithSimpleString(ctx, "capacity");
+    RedisModule_ReplyWithLongLong(ctx, table->capacity);
+    RedisModule_ReplyWithSimpleString(ctx, "slots");
+    RedisModule_ReplyWithLongLong(ctx, (table->mask + 1) * RATER_TABLE_SLOTS);
+    RedisModule_ReplyWithSimpleString(ctx, "used");
+    RedisModule_ReplyWithLongLong(ctx, table->used);
+    RedisModule_ReplyWithSimpleString(ctx, "live");
+    RedisModule_ReplyWithLongLong(ctx, live);
+    RedisModule_ReplyWithSimpleString(ctx, "evictions");
+    RedisModule_ReplyWithLongLong(ctx, table->evictions);
+    return REDISMODULE_OK;
+  }
+
+  if (rater_arg_is(argv[1], "sync")) {
+    if (argc != 5) return RedisModule_WrongArity(ctx);
+    long long hash, tat;
+    if (RedisModule_StringToLongLong(argv[3], &hash) != REDISMODULE_OK ||
+        hash == 0) {
+      return RedisModule_ReplyWithError(ctx, "ERR invalid hash");
+    }
+    if (RedisModule_StringToLongLong(argv[4], &tat) != REDISMODULE_OK ||
+        tat <= 0) {
+      return RedisModule_ReplyWithError(ctx, "ERR invalid tat");
+    }
+
+    const char *err;
+    RedisModuleKey *key =
+        RedisModule_OpenKey(ctx, argv[2], REDISMODULE_READ | REDISMODULE_WRITE);
+    rater_table *table = rater_get_table(key, &err);
+    if (table == NULL) {
+      RedisModule_CloseKey(key);
+      return RedisModule_ReplyWithError(ctx, err);
+    }
+
+    long long now = get_nanos();
+    int found;
+    rater_table_slot *slot = rater_table_find(table, hash, now, &found);
+    rater_table_store(table, slot, hash, tat, now);
+    RedisModule_CloseKey(key);
+
+    RedisModule_ReplicateVerbatim(ctx);
+    return RedisModule_ReplyWithSimpleString(ctx, "OK");
+  }
+
+  return RedisModule_ReplyWithError(ctx, "ERR unknown RATER.TABLE subcommand");
+}
+
+/* Sketches hold the limits of a key space too large to track exactly, like
+ * one per IP address and path, in a fixed array of depth rows of width cells.
+ * Each member maps to a cell of every row, and its theoretical arrival time is
+ * taken as the latest of its cells. Writes only ever move cells forward, to
+ * the new time of the member (the "conservative update" of count-min
+ * sketches), so the estimate is never earlier than the exact one: a member is
+ * never let through when it should be limited, but may be limited early when
+ * all its cells are shared with busier members. Cells whose time has passed
+ * are as good as empty, so sketches need no expiry nor eviction. */
+static RedisModuleType *RaterSketchType;
+
+#define RATER_SKETCH_ENCVER 0
+#define RATER_SKETCH_MAX_DEPTH 16
+/* Sketches are allocated at once, so cells are capped to keep a single
+ * CREATE from exhausting memory: 1 << 24 cells take 128 MB. */
+#define RATER_SKETCH_MAX_CELLS (1LL << 24)
+#define RATER_SKETCH_CHUNK 1024
+/* INFO estimates live cells from up to this many cells of every row */
+#define RATER_SKETCH_INFO_SAMPLE 1024
+
+typedef struct rater_sketch {
+  uint64_t seed;
+  long long width, depth;
+  long long used; /* Cells ever written */
+  long long *cells; /* depth rows of width cells */
+} rater_sketch;
+
+static rater_sketch *rater_sketch_create(long long width, long long depth,
+                                         uint64_t seed) {
+  rater_sketch *sketch = RedisModule_Alloc(sizeof(*sketch));
+  sketch->seed = seed;
+  sketch->width = width;
+  sketch->depth = depth;
+  sketch->used = 0;
+  sketch->cells = RedisModule_Calloc(width * depth, sizeof(long long));
+  return sketch;
+}
+
+/* rater_sketch_set moves cell forward to tat, counting it if first used. */
+static void rater_sketch_set(rater_sketch *sketch, long long *cell,
+                             long long tat) {
+  if (*cell < tat) {
+    sketch->used += *cell == 0;
+    *cell = tat;
+  }
+}
+
+/* rater_mix64 is the finalizer of splitmix64. */
+static uint64_t rater_mix64(uint64_t x) {
+  x ^= x >> 30;
+  x *= 0xbf58476d1ce4e5b9ULL;
+  x ^= x >> 27;
+  x *= 0x94d049bb133111ebULL;
+  x ^= x >> 31;
+  return x;
+}
+
+/* rater_sketch_cells finds the cell of every row for hash. */
+static void rater_sketch_cells(const rater_sketch *sketch, uint64_t hash,
+                               long long **cells) {
+  for (long long i = 0; i < sketch->depth; i++) {
+    uint64_t h = rater_mix64(hash + i * 0x9e3779b97f4a7c15ULL);
+    uint64_t j = ((unsigned __int128) h * (uint64_t) sketch->width) >> 64;
+    cells[i] = &sketch->cells[i * sketch->width + j];
+  }
+}
+
+/* rater_sketch_update moves the cells of hash forward to tat. */
+static void rater_sketch_update(rater_sketch *sketch, uint64_t hash,
+                                long long tat) {
+  long long *cells[RATER_SKETCH_MAX_DEPTH];
+  rater_sketch_cells(sketch, hash, cells);
+  for (long long i = 0; i < sketch->depth; i++) {
+    rater_sketch_set(sketch, cells[i], tat);
+  }
+}
+
+static void *rater_sketch_rdb_load(RedisModuleIO *rdb, int encver) {
+  if (encver != RATER_SKETCH_ENCVER) {
+    RedisModule_LogIOError(rdb, "warning",
+                           "Can't load rater-skt with encver %d", encver);
+    return NULL;
+  }
+  uint64_t seed = RedisModule_LoadUnsigned(rdb);
+  long long width = RedisModule_LoadSigned(rdb);
+  long long depth = RedisModule_LoadSigned(rdb);
+  if (width <= 0 || width > RATER_SKETCH_MAX_CELLS || depth <= 0 ||
+      depth > RATER_SKETCH_MAX_DEPTH || width * depth > RATER_SKETCH_MAX_CELLS) {
+    RedisModule_LogIOError(rdb, "warning", "Invalid rater-skt size %lldx%lld",
+                           width, depth);
+    return NULL;
+  }
+  rater_sketch *sketch = rater_sketch_create(width, depth, seed);
+
+  /* Cells are saved in chunks of little-endian integers */
+  long long count = width * depth;
+  for (long long offset = 0; offset < count; offset += RATER_SKETCH_CHUNK) {
+    size_t len;
+    char *buf = RedisModule_LoadStringBuffer(rdb, &len);
+    for (size_t i = 0; i < len / 8 && offset + (long long) i < count; i++) {
+      rater_sketch_set(sketch, &sketch->cells[offset + i],
+                       rater_get_int64(buf + i * 8));
+    }
+    RedisModule_Free(buf);
+  }
+  return sketch;
+}
+
+static void rater_sketch_rdb_save(RedisModuleIO *rdb, void *ptr) {
+  rater_sketch *sketch = ptr;
+  RedisModule_SaveUnsigned(rdb, sketch->seed);
+  RedisModule_SaveSigned(rdb, sketch->width);
+  RedisModule_SaveSigned(rdb, sketch->depth);
+
+  char buf[RATER_SKETCH_CHUNK * 8];
+  long long count = sketch->width * sketch->depth;
+  for (long long offset = 0; offset < count; offset += RATER_SKETCH_CHUNK) {
+    long long len = count - offset < RATER_SKETCH_CHUNK ? count - offset
+                                                        : RATER_SKETCH_CHUNK;
+    for (long long i = 0; i < len; i++) {
+      rater_put_int64(buf + i * 8, sketch->cells[offset + i]);
+    }
+    RedisModule_SaveStringBuffer(rdb, buf, len * 8);
+  }
+}
+
+/* Cells are rewritten in chunks, skipping those where no time is pending. */
+static void rater_sketch_aof_rewrite(RedisModuleIO *aof, RedisModuleString *key,
+                                     void *ptr) {
+  rater_sketch *sketch = ptr;
+  long long now = get_nanos();
+  RedisModule_EmitAOF(aof, "RATER.SKETCH", "cslll", "CREATE", key,
+                      sketch->width, sketch->depth, (long long) sketch->seed);
+
+  char buf[RATER_SKETCH_CHUNK * 8];
+  long long count = sketch->width * sketch->depth;
+  for (long long offset = 0; offset < count; offset += RATER_SKETCH_CHUNK) {
+    long long len = count - offset < RATER_SKETCH_CHUNK ? count - offset
+                                                        : RATER_SKETCH_CHUNK;
+    int live = 0;
+    for (long long i = 0; i < len; i++) {
+      long long tat = sketch->cells[offset + i];
+      live |= tat > now;
+      rater_put_int64(buf + i * 8, tat > now ? tat : 0);
+    }
+    if (live) {
+      RedisModule_EmitAOF(aof, "RATER.SKETCH", "cslb", "LOAD", key, offset,
+                          buf, (size_t) len * 8);
+    }
+  }
+}
+
+static size_t rater_sketch_mem_usage(const void *ptr) {
+  const rater_sketch *sketch = ptr;
+  return sizeof(*sketch) + sketch->width * sketch->depth * sizeof(long long);
+}
+
+static void rater_sketch_digest(RedisModuleDigest *md, void *ptr) {
+  rater_sketch *sketch = ptr;
+  long long now = get_nanos();
+  for (long long i = 0; i < sketch->width * sketch->depth; i++) {
+    RedisModule_DigestAddLongLong(md,
+                                  sketch->cells[i] > now ? sketch->cells[i] : 0);
+  }
+  RedisModule_DigestEndSequence(md);
+}
+
+static void rater_sketch_free(void *ptr) {
+  rater_sketch *sketch = ptr;
+  RedisModule_Free(sketch->cells);
+  RedisModule_Free(sketch);
+}
+
+/* rater_get_sketch returns the sketch stored on key, or sets err. */
+static rater_sketch *rater_get_sketch(RedisModuleKey *key, const char **err) {
+  if (RedisModule_KeyType(key) == REDISMODULE_KEYTYPE_EMPTY) {
+    *err = "ERR no such sketch";
+    return NULL;
+  }
+  if (RedisModule_ModuleTypeGetType(key) != RaterSketchType) {
+    *err = REDISMODULE_ERRORMSG_WRONGTYPE;
+    return NULL;
+  }
+  return RedisModule_ModuleTypeGetValue(key);
+}
+
+static int rater_sketch_limit(RedisModuleCtx *ctx, RedisModuleString **argv,
+                              int argc) {
+  /* RATER.SKETCH LIMIT <sketch> <member> <burst> <count per period> <period>
+   *                    [<quantity>] [UNIT s|ms|us] */
+  if (argc < 7) return RedisModule_WrongArity(ctx);
+  long long start = rater_stats_start();
+
+  rater_params params;
+  rater_options options;
+  long long quantity;
+  const char *err = rater_parse_limit(&argv[4], &params);
+  if (!err) err = rater_parse_tail(&argv[7], argc - 7, &quantity, &options);
+  if (!err) err = rater_gcra_only(&options);
+
+  if (err) {
+    return rater_stats_parse_error(ctx, err);
+  }
+
+  RedisModuleKey *key = RedisModule_OpenKey(ctx, argv[2], REDISMODULE_READ);
+  rater_sketch *sketch = rater_get_sketch(key, &err);
+  RedisModule_CloseKey(key);
+  if (sketch == NULL) {
+    rater_stat.wrongtype++;
+    return RedisModule_ReplyWithError(ctx, err);
+  }
+
+  size_t len;
+  const char *member = RedisModule_StringPtrLen(argv[3], &len);
+  uint64_t hash = rater_hash(member, len, sketch->seed);
+  long long *cells[RATER_SKETCH_MAX_DEPTH];
+  rater_sketch_cells(sketch, hash, cells);
+  long long tat = 0;
+  for (long long i = 0; i < sketch->depth; i++) {
+    if (*cells[i] > tat) tat = *cells[i];
+  }
+
+  long long limited = 0, limit = 0, remaining = 0, retry_after = 0, ttl = 0;
+  long long new_tat = rater_limit(&params, tat, options.now, quantity,
+                                  &limited, &limit, &remaining, &retry_after,
+                                  &ttl);
+
+  if (new_tat > 0) {
+    key = RedisModule_OpenKey(ctx, argv[2], REDISMODULE_READ | REDISMODULE_WRITE);
+    for (long long i = 0; i < sketch->depth; i++) {
+      rater_sketch_set(sketch, cells[i], new_tat);
+    }
+    RedisModule_CloseKey(key);
+#ifndef USE_MONOTONIC_CLOCK
+    RedisModule_Replicate(ctx, "RATER.SKETCH", "csll", "SYNC", argv[2],
+                          (long long) hash, new_tat);
+#endif
+  }
+
+  rater_stats_count(ctx, argv[3], quantity, limited);
+  rater_reply(ctx, limited, limit, remaining, retry_after, ttl, &options);
+  rater_stats_end(start);
+  return REDISMODULE_OK;
+}
+
+int RaterSketch_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv,
+                             int argc) {
+  /* RATER.SKETCH CREATE <sketch> <width> <depth> [<seed>]
+   * RATER.SKETCH LIMIT <sketch> <member> <burst> <count per period> <period>
+   *                    [<quantity>]
+   * RATER.SKETCH INFO <sketch>
+   * RATER.SKETCH SYNC <sketch> <hash> <tat>
+   * RATER.SKETCH LOAD <sketch> <offset> <cells> */
+  if (argc < 3) return RedisModule_WrongArity(ctx);
+
+  if (rater_arg_is(argv[1], "limit")) {
+    return rater_sketch_limit(ctx, argv, argc);
+  }
+
+  if (rater_arg_is(argv[1], "create")) {
+    if (argc < 5 || argc > 6) return RedisModule_WrongArity(ctx);
+    long long width, depth, seed = 0;
+    if (RedisModule_StringToLongLong(argv[3], &width) != REDISMODULE_OK ||
+        width <= 0 || width > RATER_SKETCH_MAX_CELLS) {
+      return RedisModule_ReplyWithError(ctx, "ERR invalid width");
+    }
+    if (RedisModule_StringToLongLong(argv[4], &depth) != REDISMODULE_OK ||
+        depth <= 0 || depth > RATER_SKETCH_MAX_DEPTH ||
+        width * depth > RATER_SKETCH_MAX_CELLS) {
+      return RedisModule_ReplyWithError(ctx, "ERR invalid depth");
+    }
+    if (argc == 6) {
+      if (RedisModule_StringToLongLong(argv[5], &seed) != REDISMODULE_OK) {
+        return RedisModule_ReplyWithError(ctx, "ERR invalid seed");
+      }
+    } else {
+      seed = (long long) rater_mix64(get_nanos() ^ (uintptr_t) argv);
+    }
+
+    RedisModuleKey *key =
+        RedisModule_OpenKey(ctx, argv[2], REDISMODULE_READ | REDISMODULE_WRITE);
+    if (RedisModule_KeyType(key) != REDISMODULE_KEYTYPE_EMPTY) {
+      RedisModule_CloseKey(key);
+      return RedisModule_ReplyWithError(ctx, "ERR sketch already exists");
+    }
+    RedisModule_ModuleTypeSetValue(key, RaterSketchType,
+                                   rater_sketch_create(width, depth, seed));
+    RedisModule_CloseKey(key);
+
+    /* Replicas must use the same seed */
+    RedisModule_Replicate(ctx, "RATER.SKETCH", "cslll", "CREATE", argv[2],
+                          width, depth, seed);
+    return RedisModule_ReplyWithSimpleString(ctx, "OK");
+  }
 
-/* nanoseconds per second */
-#define NSEC_PER_SEC 1000000000LL
+  if (rater_arg_is(argv[1], "info")) {
+    if (argc != 3) return RedisModule_WrongArity(ctx);
+    const char *err;
+    RedisModuleKey *key = RedisModule_OpenKey(ctx, argv[2], REDISMODULE_READ);
+    rater_sketch *sketch = rater_get_sketch(key, &err);
+    RedisModule_CloseKey(key);
+    if (sketch == NULL) return RedisModule_ReplyWithError(ctx, err);
 
-/* microseconds per second */
-#define USEC_PER_SEC 1000000LL
+    /* A new member is limited early when the cells it maps to are all taken,
+     * which happens as often as the product of the share of cells taken in
+     * every row. Members are spread evenly by their hash, so wide rows are
+     * sampled rather than scanned. */
+    long long now = get_nanos(), live = 0;
+    long long step = sketch->width > RATER_SKETCH_INFO_SAMPLE
+                         ? sketch->width / RATER_SKETCH_INFO_SAMPLE
+                         : 1;
+    double false_limit_rate = 1;
+    for (long long i = 0; i < sketch->depth; i++) {
+      long long row = 0, sampled = 0;
+      for (long long j = 0; j < sketch->width; j += step, sampled++) {
+        row += sketch->cells[i * sketch->width + j] > now;
+      }
+      live += row * sketch->width / sampled;
+      false_limit_rate *= (double) row / sampled;
+    }
 
-/* miliseconds per second */
-#define MSEC_PER_SEC 1000LL
+    RedisModule_ReplyWithArray(ctx, 10);
+    RedisModule_ReplyWithSimpleString(ctx, "width");
+    RedisModule_ReplyWithLongLong(ctx, sketch->width);
+    RedisModule_ReplyWithSimpleString(ctx, "depth");
+    RedisModule_ReplyWithLongLong(ctx, sketch->depth);
+    RedisModule_ReplyWithSimpleString(ctx, "used");
+    RedisModule_ReplyWithLongLong(ctx, sketch->used);
+    RedisModule_ReplyWithSimpleString(ctx, "live");
+    RedisModule_ReplyWithLongLong(ctx, live);
+    RedisModule_ReplyWithSimpleString(ctx, "false_limit_rate");
+    RedisModule_ReplyWithDouble(ctx, false_limit_rate);
+    return REDISMODULE_OK;
+  }
 
-/* get_nanos returns the nanosecond-precise time of the specified clock
- * (RATE_LIMITER_CLOCK). This clock could be either a realtime clock (default)
- * or a monotonic clock, depending on the requirements of the user.
- */
-static long long get_nanos() {
-  struct timespec ts;
-  clock_gettime(RATE_LIMITER_CLOCK, &ts);
-  return ((long long) ts.tv_sec) * NSEC_PER_SEC + ts.tv_nsec;
+  int sync = rater_arg_is(argv[1], "sync");
+  if (sync || rater_arg_is(argv[1], "load")) {
+    if (argc != 5) return RedisModule_WrongArity(ctx);
+    long long arg;
+    if (RedisModule_StringToLongLong(argv[3], &arg) != REDISMODULE_OK ||
+        (!sync && arg < 0)) {
+      return RedisModule_ReplyWithError(ctx, sync ? "ERR invalid hash"
+                                                  : "ERR invalid offset");
+    }
+
+    const char *err;
+    RedisModuleKey *key =
+        RedisModule_OpenKey(ctx, argv[2], REDISMODULE_READ | REDISMODULE_WRITE);
+    rater_sketch *sketch = rater_get_sketch(key, &err);
+    if (sketch == NULL) {
+      RedisModule_CloseKey(key);
+      return RedisModule_ReplyWithError(ctx, err);
+    }
+
+    if (sync) {
+      long long tat;
+      if (RedisModule_StringToLongLong(argv[4], &tat) != REDISMODULE_OK ||
+          tat <= 0) {
+        RedisModule_CloseKey(key);
+        return RedisModule_ReplyWithError(ctx, "ERR invalid tat");
+      }
+      rater_sketch_update(sketch, arg, tat);
+    } else {
+      size_t len;
+      const char *buf = RedisModule_StringPtrLen(argv[4], &len);
+      if (len % 8 != 0 ||
+          arg + (long long) len / 8 > sketch->width * sketch->depth) {
+        RedisModule_CloseKey(key);
+        return RedisModule_ReplyWithError(ctx, "ERR invalid cells");
+      }
+      for (size_t i = 0; i < len / 8; i++) {
+        rater_sketch_set(sketch, &sketch->cells[arg + i],
+                         rater_get_int64(buf + i * 8));
+      }
+    }
+    RedisModule_CloseKey(key);
+
+    RedisModule_ReplicateVerbatim(ctx);
+    return RedisModule_ReplyWithSimpleString(ctx, "OK");
+  }
+
+  return RedisModule_ReplyWithError(ctx, "ERR unknown RATER.SKETCH subcommand");
 }
 
-/* rater_limit checks whether a particular key has exceeded a rate limit.
- * burst defines the maximum amount permitted in a single instant while
- * count_per_period / period_in_sec defines the maximum sustained rate.
- *
- * If the rate limit has not been exceeded, the underlying storage
- * is updated by the supplied quantity. For example, a quantity of
- * 1 might be used to rate limit a single request while a greater
- * quantity could rate limit based on the size of a file upload in
- * megabytes. If quantity is 0, no update is performed allowing
- * you to "peek" at the state of the rate limiter for a given key. */
-static long long rater_limit(long long tat, long long burst,
-                             long long count_per_period,
-                             long long period_in_sec, long long quantity,
-                             long long *limited, long long *limit,
-                             long long *remaining, long long *retry_after,
-                             long long *ttl) {
-  *limited = 0;
-  *retry_after = -1;
-  *limit = burst + 1;
-  *remaining = 0;
+/* Semaphores limit how much is in flight at once rather than a rate: a
+ * rater-sem value holds the units of its capacity acquired by each holder,
+ * until released or until the lease of the holder runs out, which recovers
+ * the units of clients that crashed. Holders are kept sorted by the end of
+ * their lease, so expired ones are always first. */
+static RedisModuleType *RaterSemType;
 
-  /* emission_interval is the time between events in the nominal equally
-   * spaced events. If you like leaky buckets, think of it as how frequently
-   * the bucket leaks one unit. */
-  long long emission_interval =
-      (long long) ((double) (period_in_sec * NSEC_PER_SEC) / count_per_period);
+#define RATER_SEM_ENCVER 0
 
-  /* delay_variation_tolerance is our flexibility:
-   * How far can you deviate from the nominal equally spaced schedule?
-   * If you like leaky buckets, think about it as the size of your bucket. */
-  long long delay_variation_tolerance = emission_interval * (burst + 1);
+/* Holders of a single semaphore, which also bounds the size of the AOF. */
+#define RATER_SEM_MAX_HOLDERS 1024
 
-  /* current time in nanoseconds to increase precision. */
-  long long now = get_nanos();
+typedef struct rater_sem_holder {
+  long long token, weight;
+  long long expires; /* in nanoseconds */
+} rater_sem_holder;
+
+typedef struct rater_sem {
+  long long capacity;
+  uint32_t len, cap;
+  rater_sem_holder *holders;
+} rater_sem;
+
+/* Tokens are drawn from this sequence along with the clock, so that a token
+ * outliving its semaphore is unlikely to release a later holder. */
+static uint64_t rater_sem_seq = 0;
+
+static rater_sem *rater_sem_create(long long capacity) {
+  rater_sem *sem = RedisModule_Calloc(1, sizeof(*sem));
+  sem->capacity = capacity;
+  return sem;
+}
 
-  /* tat refers to the theoretical arrival time that would be expected
-   * from equally spaced requests at exactly the rate limit. */
-  if (tat == 0) {
-    tat = now;
+/* rater_sem_add adds a holder, keeping holders sorted by expires. */
+static void rater_sem_add(rater_sem *sem, long long token, long long weight,
+                          long long expires) {
+  if (sem->len == sem->cap) {
+    sem->cap = sem->cap ? sem->cap * 2 : 4;
+    sem->holders =
+        RedisModule_Realloc(sem->holders, sizeof(*sem->holders) * sem->cap);
+  }
+  uint32_t i = sem->len++;
+  for (; i > 0 && sem->holders[i - 1].expires > expires; i--) {
+    sem->holders[i] = sem->holders[i - 1];
   }
+  sem->holders[i] = (rater_sem_holder){token, weight, expires};
+}
 
-  long long increment = emission_interval * quantity;
-  long long new_tat;
-  if (now > tat) {
-    new_tat = now + increment;
-  } else {
-    new_tat = tat + increment;
+/* rater_sem_remove removes the i-th holder. */
+static void rater_sem_remove(rater_sem *sem, uint32_t i) {
+  memmove(&sem->holders[i], &sem->holders[i + 1],
+          sizeof(*sem->holders) * (sem->len - i - 1));
+  sem->len--;
+}
+
+/* rater_sem_expired returns how many holders had their lease run out by now,
+ * which are the first ones. */
+static uint32_t rater_sem_expired(const rater_sem *sem, long long now) {
+  uint32_t expired = 0;
+  while (expired < sem->len && sem->holders[expired].expires <= now) {
+    expired++;
+  }
+  return expired;
+}
+
+/* rater_sem_expire removes the holders whose lease ran out by now, returning
+ * whether there were any. */
+static int rater_sem_expire(rater_sem *sem, long long now) {
+  uint32_t expired = rater_sem_expired(sem, now);
+  if (expired == 0) return 0;
+  memmove(sem->holders, &sem->holders[expired],
+          sizeof(*sem->holders) * (sem->len - expired));
+  sem->len -= expired;
+  return 1;
+}
+
+/* rater_sem_used sums the units of the holders from the from-th one on. */
+static long long rater_sem_used(const rater_sem *sem, uint32_t from) {
+  long long used = 0;
+  for (uint32_t i = from; i < sem->len; i++) {
+    used = rater_saturate((__int128) used + sem->holders[i].weight);
+  }
+  return used;
+}
+
+static void *rater_sem_rdb_load(RedisModuleIO *rdb, int encver) {
+  if (encver != RATER_SEM_ENCVER) {
+    RedisModule_LogIOError(rdb, "warning",
+                           "Can't load rater-sem with encver %d", encver);
+    return NULL;
+  }
+  rater_sem *sem = rater_sem_create(RedisModule_LoadSigned(rdb));
+  uint64_t len = RedisModule_LoadUnsigned(rdb);
+  for (uint64_t i = 0; i < len; i++) {
+    long long token = RedisModule_LoadSigned(rdb);
+    long long weight = RedisModule_LoadSigned(rdb);
+    rater_sem_add(sem, token, weight, RedisModule_LoadSigned(rdb));
+  }
+  return sem;
+}
+
+static void rater_sem_rdb_save(RedisModuleIO *rdb, void *ptr) {
+  rater_sem *sem = ptr;
+  RedisModule_SaveSigned(rdb, sem->capacity);
+  RedisModule_SaveUnsigned(rdb, sem->len);
+  for (uint32_t i = 0; i < sem->len; i++) {
+    RedisModule_SaveSigned(rdb, sem->holders[i].token);
+    RedisModule_SaveSigned(rdb, sem->holders[i].weight);
+    RedisModule_SaveSigned(rdb, sem->holders[i].expires);
+  }
+}
+
+/* rater_sem_args returns the arguments of RATER.SEMSET that store sem on the
+ * key named keyname, to free with rater_sem_free_args. */
+static RedisModuleString **rater_sem_args(RedisModuleCtx *ctx,
+                                          RedisModuleString *keyname,
+                                          const rater_sem *sem, size_t *argc) {
+  *argc = 3 + sem->len * 3;
+  RedisModuleString **argv = RedisModule_Alloc(sizeof(*argv) * *argc);
+  argv[0] = RedisModule_CreateStringFromString(ctx, keyname);
+  argv[1] = RedisModule_CreateStringFromLongLong(ctx, sem->capacity);
+  argv[2] = RedisModule_CreateStringFromLongLong(ctx, REDISMODULE_NO_EXPIRE);
+  for (uint32_t i = 0; i < sem->len; i++) {
+    const rater_sem_holder *holder = &sem->holders[i];
+    argv[3 + i * 3] = RedisModule_CreateStringFromLongLong(ctx, holder->token);
+    argv[4 + i * 3] = RedisModule_CreateStringFromLongLong(ctx, holder->weight);
+    argv[5 + i * 3] = RedisModule_CreateStringFromLongLong(ctx, holder->expires);
+  }
+  return argv;
+}
+
+static void rater_sem_free_args(RedisModuleCtx *ctx, RedisModuleString **argv,
+                                size_t argc) {
+  for (size_t i = 0; i < argc; i++) {
+    RedisModule_FreeString(ctx, argv[i]);
+  }
+  RedisModule_Free(argv);
+}
+
+/* The expire of the key is rewritten on its own. */
+static void rater_sem_aof_rewrite(RedisModuleIO *aof, RedisModuleString *key,
+                                  void *ptr) {
+  RedisModuleCtx *ctx = RedisModule_GetContextFromIO(aof);
+  size_t argc;
+  RedisModuleString **argv = rater_sem_args(ctx, key, ptr, &argc);
+  RedisModule_EmitAOF(aof, "RATER.SEMSET", "v", argv, argc);
+  rater_sem_free_args(ctx, argv, argc);
+}
+
+static size_t rater_sem_mem_usage(const void *ptr) {
+  const rater_sem *sem = ptr;
+  return sizeof(*sem) + sizeof(*sem->holders) * sem->cap;
+}
+
+static void rater_sem_digest(RedisModuleDigest *md, void *ptr) {
+  rater_sem *sem = ptr;
+  RedisModule_DigestAddLongLong(md, sem->capacity);
+  for (uint32_t i = 0; i < sem->len; i++) {
+    RedisModule_DigestAddLongLong(md, sem->holders[i].token);
+    RedisModule_DigestAddLongLong(md, sem->holders[i].weight);
+    RedisModule_DigestAddLongLong(md, sem->holders[i].expires);
+  }
+  RedisModule_DigestEndSequence(md);
+}
+
+static void rater_sem_free(void *ptr) {
+  rater_sem *sem = ptr;
+  RedisModule_Free(sem->holders);
+  RedisModule_Free(sem);
+}
+
+/* rater_get_sem returns the semaphore of key, or NULL if the key is empty or
+ * holds something else, which sets err. */
+static rater_sem *rater_get_sem(RedisModuleKey *key, const char **err) {
+  *err = NULL;
+  if (RedisModule_KeyType(key) == REDISMODULE_KEYTYPE_EMPTY) {
+    return NULL;
   }
+  if (RedisModule_ModuleTypeGetType(key) != RaterSemType) {
+    *err = REDISMODULE_ERRORMSG_WRONGTYPE;
+    return NULL;
+  }
+  return RedisModule_ModuleTypeGetValue(key);
+}
 
-  /* Block the request if the next permitted time is in the future. */
-  long long allow_at = new_tat - delay_variation_tolerance;
-  long long diff = now - allow_at;
-  if (diff < 0) {
-    new_tat = 0;
-    *limited = 1;
-    *ttl = tat - now;
-    if (increment <= delay_variation_tolerance) {
-      *retry_after = -diff / NSEC_PER_SEC;
+/* rater_sem_store stores sem, updated as of now, on key, opened for writing as
+ * keyname and which may already hold it, and replicates the update as
+ * RATER.SEMSYNC with the holder that changed: added, or removed if its weight
+ * is 0. Empty semaphores are deleted, along with sem, which returns NULL. */
+static rater_sem *rater_sem_store(RedisModuleCtx *ctx, RedisModuleKey *key,
+                                  RedisModuleString *keyname, rater_sem *sem,
+                                  long long now,
+                                  const rater_sem_holder *change) {
+  if (sem->len == 0) {
+    if (RedisModule_KeyType(key) == REDISMODULE_KEYTYPE_EMPTY) {
+      rater_sem_free(sem);
+    } else {
+      RedisModule_DeleteKey(key);
+      RedisModule_Replicate(ctx, "DEL", "s", keyname);
     }
-  } else {
-    *ttl = new_tat - now;
+    return NULL;
   }
 
-  long long next = delay_variation_tolerance - *ttl;
-  if (next > -emission_interval) {
-    *remaining = next / emission_interval;
+  if (RedisModule_KeyType(key) == REDISMODULE_KEYTYPE_EMPTY) {
+    RedisModule_ModuleTypeSetValue(key, RaterSemType, sem);
   }
+  long long ttl = sem->holders[sem->len - 1].expires - now;
+  long long ms = ttl / NSEC_PER_MSEC + (ttl % NSEC_PER_MSEC != 0);
+  ms = rater_set_expire(key, ms);
+#ifndef USE_MONOTONIC_CLOCK
+  RedisModule_Replicate(ctx, "RATER.SEMSYNC", "sllllll", keyname,
+                        sem->capacity, now, ms, change->token, change->weight,
+                        change->expires);
+#else /*!USE_MONOTONIC_CLOCK*/
+  REDISMODULE_NOT_USED(change);
+#endif /*USE_MONOTONIC_CLOCK*/
+  return sem;
+}
 
-  *ttl = *ttl / USEC_PER_SEC;
+/* rater_sem_reply replies with the state of sem as of now, after a call for
+ * quantity units, with the outcome of the call: limited is 1 if the units
+ * could not be acquired. retry_after is when enough leases run out for them,
+ * should no holder release its units first. */
+static void rater_sem_reply(RedisModuleCtx *ctx, const rater_sem *sem,
+                            long long capacity, long long quantity,
+                            long long now, int limited,
+                            const rater_field *extra,
+                            const rater_options *options) {
+  long long used = sem ? rater_sem_used(sem, 0) : 0;
+  long long remaining = used < capacity ? capacity - used : 0;
+  long long retry_after = -1, ttl = 0;
+  if (sem && sem->len > 0) {
+    ttl = sem->holders[sem->len - 1].expires - now;
+    if (limited && quantity <= capacity) {
+      long long needed = quantity - (capacity - used);
+      for (uint32_t i = 0; i < sem->len && retry_after < 0; i++) {
+        needed -= sem->holders[i].weight;
+        if (needed <= 0) retry_after = sem->holders[i].expires - now;
+      }
+    }
+  }
+  rater_reply_extended(ctx, limited, capacity, remaining, retry_after, ttl,
+                       extra, 1, options);
+}
 
-  return new_tat;
+static const char *rater_parse_capacity(RedisModuleString *arg,
+                                        long long *capacity) {
+  if (RedisModule_StringToLongLong(arg, capacity) != REDISMODULE_OK ||
+      *capacity <= 0) {
+    return "ERR invalid capacity";
+  }
+  return NULL;
 }
 
-int RaterLimit_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv,
-                            int argc) {
-  /* RATER.LIMIT <key> <burst> <count per period> <period> [<quantity>] */
-  if (argc < 5 || argc > 6) return RedisModule_WrongArity(ctx);
+int RaterAcquire_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv,
+                              int argc) {
+  /* RATER.ACQUIRE <key> <capacity> <lease> [<quantity>] [UNIT s|ms|us]
+   *
+   * Acquires quantity units of a semaphore of capacity units for lease
+   * milliseconds at most. Replies like RATER.LIMIT, followed by the token to
+   * release the units with, or -1 when limited. A quantity of 0 only reports
+   * the state of the semaphore. */
+  if (argc < 4) return RedisModule_WrongArity(ctx);
+  long long start = rater_stats_start();
+
+  rater_options options;
+  long long capacity, lease, quantity;
+  const char *err = rater_parse_capacity(argv[2], &capacity);
+  if (!err && (RedisModule_StringToLongLong(argv[3], &lease) !=
+                   REDISMODULE_OK ||
+               lease <= 0)) {
+    err = "ERR invalid lease";
+  }
+  if (!err) err = rater_parse_tail(&argv[4], argc - 4, &quantity, &options);
+  if (!err) err = rater_gcra_only(&options);
+  if (err) return rater_stats_parse_error(ctx, err);
 
-  /* Parse and validate the arguments, in their order. */
-  long long tat = 0;
   RedisModuleKey *key =
       RedisModule_OpenKey(ctx, argv[1], REDISMODULE_READ | REDISMODULE_WRITE);
-  /* Key must be empty or string. */
-  if (RedisModule_KeyType(key) == REDISMODULE_KEYTYPE_STRING) {
-    /* Given how the Redis API works, we first must get a RedisModuleString from
-     * the key. */
-    size_t len;
-    const char *raw_tat_str =
-        RedisModule_StringDMA(key, &len, REDISMODULE_READ);
-    RedisModuleString *tat_str =
-        RedisModule_CreateString(ctx, raw_tat_str, len);
+  rater_sem *sem = rater_get_sem(key, &err);
+  if (err) {
+    RedisModule_CloseKey(key);
+    rater_stat.wrongtype++;
+    return RedisModule_ReplyWithError(ctx, err);
+  }
 
-    if (RedisModule_StringToLongLong(tat_str, &tat) != REDISMODULE_OK) {
-      RedisModule_FreeString(ctx, tat_str);
-      RedisModule_CloseKey(key);
-      return RedisModule_ReplyWithError(ctx, "ERR invalid stored rater");
+  /* The semaphore is left untouched until the call is known to go through. */
+  long long now = options.now;
+  uint32_t expired = sem ? rater_sem_expired(sem, now) : 0;
+  long long used = sem ? rater_sem_used(sem, expired) : 0;
+  int limited = quantity > capacity - used;
+  int acquired = !limited && quantity > 0;
+  if (acquired && sem && sem->len - expired >= RATER_SEM_MAX_HOLDERS) {
+    RedisModule_CloseKey(key);
+    return RedisModule_ReplyWithError(ctx, "ERR too many holders");
+  }
+
+  int changed = sem ? rater_sem_expire(sem, now) : 0;
+  if (sem && sem->capacity != capacity) {
+    sem->capacity = capacity;
+    changed = 1;
+  }
+
+  rater_field token = {"token", -1};
+  rater_sem_holder change = {0, 0, 0};
+  if (acquired) {
+    if (!sem) sem = rater_sem_create(capacity);
+
+    /* Tokens are positive and unique within the semaphore */
+    for (int unique = 0; !unique;) {
+      token.value = (long long) (rater_mix64((uint64_t) now ^ ++rater_sem_seq) &
+                                 LLONG_MAX);
+      unique = token.value > 0;
+      for (uint32_t i = 0; unique && i < sem->len; i++) {
+        unique = sem->holders[i].token != token.value;
+      }
     }
-    RedisModule_FreeString(ctx, tat_str);
-  } else if (RedisModule_KeyType(key) != REDISMODULE_KEYTYPE_EMPTY) {
-    /* If the key is not a string and is not empty it is the wrong type. */
+    change = (rater_sem_holder){
+        token.value, quantity,
+        rater_saturate((__int128) now + (__int128) lease * NSEC_PER_MSEC)};
+    rater_sem_add(sem, change.token, change.weight, change.expires);
+    changed = 1;
+  }
+  if (changed) sem = rater_sem_store(ctx, key, argv[1], sem, now, &change);
+  RedisModule_CloseKey(key);
+
+  rater_stats_count(ctx, argv[1], quantity, limited);
+  rater_sem_reply(ctx, sem, capacity, quantity, now, limited, &token,
+                  &options);
+  rater_stats_end(start);
+  return REDISMODULE_OK;
+}
+
+int RaterRelease_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv,
+                              int argc) {
+  /* RATER.RELEASE <key> <token> [UNIT s|ms|us]
+   *
+   * Releases the units acquired with token, unless its lease already ran out.
+   * Replies like a RATER.ACQUIRE of 0 units after that, followed by whether
+   * the token was released. */
+  if (argc < 3) return RedisModule_WrongArity(ctx);
+  long long start = rater_stats_start();
+
+  rater_options options;
+  long long token;
+  const char *err = NULL;
+  if (RedisModule_StringToLongLong(argv[2], &token) != REDISMODULE_OK) {
+    err = "ERR invalid token";
+  }
+  if (!err) err = rater_parse_options(&argv[3], argc - 3, &options);
+  if (!err) err = rater_gcra_only(&options);
+  if (err) return rater_stats_parse_error(ctx, err);
+
+  RedisModuleKey *key =
+      RedisModule_OpenKey(ctx, argv[1], REDISMODULE_READ | REDISMODULE_WRITE);
+  rater_sem *sem = rater_get_sem(key, &err);
+  if (err) {
     RedisModule_CloseKey(key);
-    return RedisModule_ReplyWithError(ctx, REDISMODULE_ERRORMSG_WRONGTYPE);
+    rater_stat.wrongtype++;
+    return RedisModule_ReplyWithError(ctx, err);
+  }
+
+  long long now = options.now, capacity = 0;
+  rater_field released = {"released", 0};
+  if (sem) {
+    int changed = rater_sem_expire(sem, now);
+    rater_sem_holder change = {0, 0, 0};
+    for (uint32_t i = 0; i < sem->len; i++) {
+      if (sem->holders[i].token == token) {
+        rater_sem_remove(sem, i);
+        change.token = token;
+        released.value = changed = 1;
+        break;
+      }
+    }
+    capacity = sem->capacity;
+    if (changed) sem = rater_sem_store(ctx, key, argv[1], sem, now, &change);
+  }
+  RedisModule_CloseKey(key);
+
+  rater_sem_reply(ctx, sem, capacity, 0, now, 0, &released, &options);
+  rater_stats_end(start);
+  return REDISMODULE_OK;
+}
+
+int RaterSemSet_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv,
+                             int argc) {
+  /* RATER.SEMSET <key> <capacity> <ttl> [<token> <weight> <expires> ...]
+   *
+   * Stores a rater-sem value, as emitted by the AOF rewrite and replicated.
+   * The ttl is in milliseconds, or -1 to leave the expire of the key as is,
+   * and expires in nanoseconds. */
+  if (argc < 4 || (argc - 4) % 3 != 0) return RedisModule_WrongArity(ctx);
+
+  long long capacity, ttl;
+  const char *err = rater_parse_capacity(argv[2], &capacity);
+  if (err) return RedisModule_ReplyWithError(ctx, err);
+  if (RedisModule_StringToLongLong(argv[3], &ttl) != REDISMODULE_OK ||
+      (ttl < 0 && ttl != REDISMODULE_NO_EXPIRE)) {
+    return RedisModule_ReplyWithError(ctx, "ERR invalid ttl");
+  }
+  if ((argc - 4) / 3 > RATER_SEM_MAX_HOLDERS) {
+    return RedisModule_ReplyWithError(ctx, "ERR too many holders");
+  }
+
+  rater_sem *sem = rater_sem_create(capacity);
+  for (int i = 4; i < argc; i += 3) {
+    long long token, weight, expires;
+    if (RedisModule_StringToLongLong(argv[i], &token) != REDISMODULE_OK ||
+        RedisModule_StringToLongLong(argv[i + 1], &weight) != REDISMODULE_OK ||
+        RedisModule_StringToLongLong(argv[i + 2], &expires) != REDISMODULE_OK ||
+        weight <= 0) {
+      rater_sem_free(sem);
+      return RedisModule_ReplyWithError(ctx, "ERR invalid holder");
+    }
+    rater_sem_add(sem, token, weight, expires);
   }
 
-  long long burst = 0;
-  if (RedisModule_StringToLongLong(argv[2], &burst) != REDISMODULE_OK ||
-      burst < 0) {
+  RedisModuleKey *key =
+      RedisModule_OpenKey(ctx, argv[1], REDISMODULE_READ | REDISMODULE_WRITE);
+  if (RedisModule_KeyType(key) != REDISMODULE_KEYTYPE_EMPTY &&
+      RedisModule_ModuleTypeGetType(key) != RaterSemType) {
     RedisModule_CloseKey(key);
-    return RedisModule_ReplyWithError(ctx, "ERR invalid burst");
+    rater_sem_free(sem);
+    return RedisModule_ReplyWithError(ctx, REDISMODULE_ERRORMSG_WRONGTYPE);
   }
 
-  long long count_per_period = 0;
-  if (RedisModule_StringToLongLong(argv[3], &count_per_period) !=
-          REDISMODULE_OK ||
-      count_per_period <= 0) {
+  RedisModule_ModuleTypeSetValue(key, RaterSemType, sem);
+  if (ttl != REDISMODULE_NO_EXPIRE) {
+    RedisModule_SetExpire(key, ttl);
+  }
+  RedisModule_CloseKey(key);
+
+  RedisModule_ReplicateVerbatim(ctx);
+  return RedisModule_ReplyWithSimpleString(ctx, "OK");
+}
+
+int RaterSemSync_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv,
+                              int argc) {
+  /* RATER.SEMSYNC <key> <capacity> <now> <ttl> <token> <weight> <expires>
+   *
+   * Applies an update of a rater-sem value, as replicated: holders whose lease
+   * ran out by now are dropped, the capacity is set, and the holder is added,
+   * or removed if its weight is 0. The ttl is in milliseconds, and now and
+   * expires in nanoseconds. */
+  if (argc != 8) return RedisModule_WrongArity(ctx);
+
+  long long capacity, now, ttl, token, weight, expires;
+  const char *err = rater_parse_capacity(argv[2], &capacity);
+  if (err) return RedisModule_ReplyWithError(ctx, err);
+  if (RedisModule_StringToLongLong(argv[3], &now) != REDISMODULE_OK ||
+      RedisModule_StringToLongLong(argv[4], &ttl) != REDISMODULE_OK ||
+      ttl < 0) {
+    return RedisModule_ReplyWithError(ctx, "ERR invalid ttl");
+  }
+  if (RedisModule_StringToLongLong(argv[5], &token) != REDISMODULE_OK ||
+      RedisModule_StringToLongLong(argv[6], &weight) != REDISMODULE_OK ||
+      RedisModule_StringToLongLong(argv[7], &expires) != REDISMODULE_OK ||
+      weight < 0) {
+    return RedisModule_ReplyWithError(ctx, "ERR invalid holder");
+  }
+
+  RedisModuleKey *key =
+      RedisModule_OpenKey(ctx, argv[1], REDISMODULE_READ | REDISMODULE_WRITE);
+  rater_sem *sem = rater_get_sem(key, &err);
+  if (err) {
     RedisModule_CloseKey(key);
-    return RedisModule_ReplyWithError(ctx, "ERR invalid count_per_period");
+    return RedisModule_ReplyWithError(ctx, err);
+  }
+  if (sem == NULL) {
+    sem = rater_sem_create(capacity);
+    RedisModule_ModuleTypeSetValue(key, RaterSemType, sem);
+  }
+
+  rater_sem_expire(sem, now);
+  sem->capacity = capacity;
+  if (weight > 0) {
+    rater_sem_add(sem, token, weight, expires);
+  } else {
+    for (uint32_t i = 0; i < sem->len; i++) {
+      if (sem->holders[i].token == token) {
+        rater_sem_remove(sem, i);
+        break;
+      }
+    }
+  }
+  if (sem->len == 0) {
+    RedisModule_DeleteKey(key);
+  } else {
+    RedisModule_SetExpire(key, ttl);
+  }
+  RedisModule_CloseKey(key);
+
+  RedisModule_ReplicateVerbatim(ctx);
+  return RedisModule_ReplyWithSimpleString(ctx, "OK");
+}
+
+/* RATER.RESET deletes every limit whose key matches a glob-style pattern from
+ * a background thread, walking the keyspace of the db with RedisModule_Scan in
+ * slices that hold the global lock for at most RATER_RESET_SLICE_NS, each
+ * followed by a pause of RATER_RESET_PAUSE_NS during which commands are served
+ * as usual. Only keys holding a theoretical arrival time, a table, a sketch, a
+ * window or a semaphore are deleted, other keys matching the pattern are left alone. A
+ * single reset runs at a time, and its progress is kept until the next one. */
+#define RATER_RESET_SLICE_NS (100 * NSEC_PER_USEC)
+#define RATER_RESET_PAUSE_NS NSEC_PER_MSEC
+
+typedef struct rater_reset {
+  char *pattern;
+  int db;
+  int running;
+  long long started, finished;
+  long long scanned, deleted;
+  /* Key names matched by the last step of the scan, to delete after it */
+  RedisModuleString **batch;
+  size_t batch_len, batch_cap;
+} rater_reset;
+
+/* Written by the thread of the reset and read by RATER.RESET STATUS, both
+ * while holding the global lock. */
+static rater_reset rater_reset_job;
+
+/* rater_is_limit tells if key holds a limit of any kind. */
+static int rater_is_limit(RedisModuleKey *key) {
+  int type = RedisModule_KeyType(key);
+  if (type == REDISMODULE_KEYTYPE_MODULE) {
+    RedisModuleType *mt = RedisModule_ModuleTypeGetType(key);
+    return mt == RaterType || mt == RaterTableType || mt == RaterSketchType ||
+           mt == RaterWindowType || mt == RaterSemType;
+  }
+  long long tat;
+  return type == REDISMODULE_KEYTYPE_STRING && rater_get_tat(key, &tat) == NULL;
+}
+
+static void rater_reset_scan(RedisModuleCtx *ctx, RedisModuleString *keyname,
+                             RedisModuleKey *key, void *privdata) {
+  REDISMODULE_NOT_USED(key);
+  rater_reset *job = privdata;
+  job->scanned++;
+
+  /* Key names with a nul byte in them never match */
+  size_t len;
+  const char *name = RedisModule_StringPtrLen(keyname, &len);
+  if (strlen(name) != len || fnmatch(job->pattern, name, 0) != 0) return;
+
+  /* Keys can't be deleted while scanning, so they are kept for later */
+  if (job->batch_len == job->batch_cap) {
+    job->batch_cap = job->batch_cap ? job->batch_cap * 2 : 64;
+    job->batch = RedisModule_Realloc(job->batch,
+                                     sizeof(*job->batch) * job->batch_cap);
   }
+  job->batch[job->batch_len++] = RedisModule_CreateStringFromString(ctx,
+                                                                    keyname);
+}
 
-  long long period_in_sec;
-  if (RedisModule_StringToLongLong(argv[4], &period_in_sec) != REDISMODULE_OK ||
-      period_in_sec <= 0) {
+/* rater_reset_delete deletes the limits matched by the last step of the scan.
+ */
+static void rater_reset_delete(RedisModuleCtx *ctx, rater_reset *job) {
+  for (size_t i = 0; i < job->batch_len; i++) {
+    RedisModuleString *keyname = job->batch[i];
+    RedisModuleKey *key =
+        RedisModule_OpenKey(ctx, keyname, REDISMODULE_READ | REDISMODULE_WRITE);
+    if (rater_is_limit(key)) {
+      RedisModule_UnlinkKey(key);
+      RedisModule_Replicate(ctx, "UNLINK", "s", keyname);
+      job->deleted++;
+    }
     RedisModule_CloseKey(key);
-    return RedisModule_ReplyWithError(ctx, "ERR invalid period_in_sec");
+    RedisModule_FreeString(ctx, keyname);
   }
+  job->batch_len = 0;
+}
 
-  long long quantity = 1L;
-  if (argc == 6) {
-    if (RedisModule_StringToLongLong(argv[5], &quantity) != REDISMODULE_OK ||
-        quantity < 0) {
-      RedisModule_CloseKey(key);
-      return RedisModule_ReplyWithError(ctx, "ERR invalid quantity");
+/* Every slice works in a context of its own, freed before releasing the lock:
+ * Redis before 7.0 only propagates the commands replicated from a thread safe
+ * context when freeing it, and replicas and the AOF would otherwise lag behind
+ * by the whole reset. */
+static void *rater_reset_thread(void *arg) {
+  rater_reset *job = arg;
+  RedisModuleCtx *lock = RedisModule_GetThreadSafeContext(NULL);
+  RedisModuleScanCursor *cursor = RedisModule_ScanCursorCreate();
+  struct timespec pause = {.tv_nsec = RATER_RESET_PAUSE_NS};
+
+  for (;;) {
+    RedisModule_ThreadSafeContextLock(lock);
+    RedisModuleCtx *ctx = RedisModule_GetThreadSafeContext(NULL);
+    RedisModule_SelectDb(ctx, job->db);
+    long long deadline = rater_monotonic_nanos() + RATER_RESET_SLICE_NS;
+    int more;
+    do {
+      more = RedisModule_Scan(ctx, cursor, rater_reset_scan, job);
+      rater_reset_delete(ctx, job);
+    } while (more && rater_monotonic_nanos() < deadline);
+    if (!more) {
+      job->running = 0;
+      job->finished = rater_monotonic_nanos();
     }
+    RedisModule_FreeThreadSafeContext(ctx);
+    RedisModule_ThreadSafeContextUnlock(lock);
+    if (!more) break;
+    nanosleep(&pause, NULL);
   }
 
-  /* After all that preamble, do the Cell-Rate Limiting calculations. */
-  long long limited = 0, limit = 0, remaining = 0, retry_after = 0, ttl = 0;
-  long long new_tat =
-      rater_limit(tat, burst, count_per_period, period_in_sec, quantity,
-                  &limited, &limit, &remaining, &retry_after, &ttl);
+  RedisModule_ScanCursorDestroy(cursor);
+  RedisModule_FreeThreadSafeContext(lock);
+  return NULL;
+}
 
-  /* If there is a new theoretical arrival time, store it back on the key. */
-  if (new_tat > 0) {
-    RedisModuleString *new_tat_str =
-        RedisModule_CreateStringFromLongLong(ctx, new_tat);
-    RedisModule_StringSet(key, new_tat_str);
-    RedisModule_SetExpire(key, ttl);
+int RaterReset_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv,
+                            int argc) {
+  /* RATER.RESET <pattern>
+   * RATER.RESET STATUS
+   *
+   * Starts deleting the limits of the keys matching pattern in the background,
+   * or reports the progress of the last reset. A pattern matching STATUS
+   * itself can be written as [S]TATUS. */
+  if (argc != 2) return RedisModule_WrongArity(ctx);
+  rater_reset *job = &rater_reset_job;
 
-#ifndef USE_MONOTONIC_CLOCK
-    /* Check https://github.com/redis/redis/issues/8608 for more */
-    RedisModule_Replicate(ctx, "PSETEX", "sls", argv[1], ttl, new_tat_str);
-#endif
+  if (rater_arg_is(argv[1], "status")) {
+    if (job->pattern == NULL) return RedisModule_ReplyWithNull(ctx);
+    long long end = job->running ? rater_monotonic_nanos() : job->finished;
+    RedisModule_ReplyWithArray(ctx, 12);
+    RedisModule_ReplyWithSimpleString(ctx, "pattern");
+    RedisModule_ReplyWithStringBuffer(ctx, job->pattern, strlen(job->pattern));
+    RedisModule_ReplyWithSimpleString(ctx, "db");
+    RedisModule_ReplyWithLongLong(ctx, job->db);
+    RedisModule_ReplyWithSimpleString(ctx, "running");
+    RedisModule_ReplyWithLongLong(ctx, job->running);
+    RedisModule_ReplyWithSimpleString(ctx, "scanned");
+    RedisModule_ReplyWithLongLong(ctx, job->scanned);
+    RedisModule_ReplyWithSimpleString(ctx, "deleted");
+    RedisModule_ReplyWithLongLong(ctx, job->deleted);
+    RedisModule_ReplyWithSimpleString(ctx, "elapsed_ms");
+    RedisModule_ReplyWithLongLong(ctx, (end - job->started) / NSEC_PER_MSEC);
+    return REDISMODULE_OK;
+  }
 
-    RedisModule_FreeString(ctx, new_tat_str);
+  /* Scanning the keyspace from a module needs Redis 6.0.6 or newer */
+  if (RedisModule_Scan == NULL || RedisModule_GetThreadSafeContext == NULL) {
+    return RedisModule_ReplyWithError(
+        ctx, "ERR RATER.RESET requires Redis 6.0.6 or newer");
+  }
+  /* Scripts must not start background jobs, which deny-script would refuse
+   * on Redis 7.0 and newer only. */
+  if (RedisModule_GetContextFlags(ctx) & REDISMODULE_CTX_FLAGS_LUA) {
+    return RedisModule_ReplyWithError(
+        ctx, "ERR RATER.RESET can't be called from scripts");
+  }
+  if (job->running) {
+    return RedisModule_ReplyWithError(ctx, "ERR a reset is already running");
+  }
+  size_t len;
+  const char *pattern = RedisModule_StringPtrLen(argv[1], &len);
+  if (strlen(pattern) != len) {
+    return RedisModule_ReplyWithError(ctx, "ERR invalid pattern");
   }
 
-  RedisModule_CloseKey(key);
+  RedisModule_Free(job->pattern);
+  job->pattern = RedisModule_Strdup(pattern);
+  job->db = RedisModule_GetSelectedDb(ctx);
+  job->running = 1;
+  job->started = rater_monotonic_nanos();
+  job->scanned = job->deleted = 0;
+
+  pthread_t thread;
+  if (pthread_create(&thread, NULL, rater_reset_thread, job) != 0) {
+    job->running = 0;
+    job->finished = job->started;
+    return RedisModule_ReplyWithError(ctx, "ERR cannot start the reset");
+  }
+  pthread_detach(thread);
+  return RedisModule_ReplyWithSimpleString(ctx, "OK");
+}
+
+int RaterStats_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv,
+                            int argc) {
+  /* RATER.STATS [RESET] */
+  if (argc > 2) return RedisModule_WrongArity(ctx);
+
+  if (argc == 2) {
+    if (!rater_arg_is(argv[1], "reset")) {
+      return RedisModule_ReplyWithError(ctx, "ERR unknown RATER.STATS option");
+    }
+    memset(&rater_stat, 0, sizeof(rater_stat));
+    if (rater_topk.k > 0) rater_topk_reset();
+    return RedisModule_ReplyWithSimpleString(ctx, "OK");
+  }
+
+  long long values[sizeof(rater_stats_names) / sizeof(rater_stats_names[0])];
+  rater_stats_values(values);
+
+  int count = sizeof(values) / sizeof(values[0]) - 1;
+  RedisModule_ReplyWithArray(ctx, count * 2);
+  for (int i = 0; i < count; i++) {
+    RedisModule_ReplyWithSimpleString(ctx, rater_stats_names[i]);
+    RedisModule_ReplyWithLongLong(ctx, values[i]);
+  }
+  return REDISMODULE_OK;
+}
+
+int RaterTopLimited_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv,
+                                 int argc) {
+  /* RATER.TOPLIMITED <k>
+   *
+   * Replies with up to k of the most limited keys, most limited first, as
+   * arrays of their name, estimated count of limited calls and the most the
+   * estimate may be over by. */
+  if (argc != 2) return RedisModule_WrongArity(ctx);
+
+  long long k;
+  if (RedisModule_StringToLongLong(argv[1], &k) != REDISMODULE_OK || k < 0) {
+    return RedisModule_ReplyWithError(ctx, "ERR invalid k");
+  }
+  if (rater_topk.k == 0) {
+    return RedisModule_ReplyWithError(
+        ctx, "ERR top-k tracking is disabled, load the module with TOPK <k>");
+  }
+  if (k > rater_topk.size) k = rater_topk.size;
+
+  /* Buckets are sorted by increasing count */
+  int *order = RedisModule_PoolAlloc(ctx, sizeof(int) * (rater_topk.size + 1));
+  int n = 0;
+  for (int b = rater_topk.min_bucket; b >= 0; b = rater_topk.buckets[b].next) {
+    for (int c = rater_topk.buckets[b].first; c >= 0;
+         c = rater_topk.counters[c].next) {
+      order[n++] = c;
+    }
+  }
+
+  RedisModule_ReplyWithArray(ctx, k);
+  for (long long i = 0; i < k; i++) {
+    rater_topk_counter *counter = &rater_topk.counters[order[n - 1 - i]];
+    RedisModule_ReplyWithArray(ctx, 3);
+    RedisModule_ReplyWithStringBuffer(ctx, counter->name, counter->len);
+    RedisModule_ReplyWithLongLong(ctx,
+                                  rater_topk.buckets[counter->bucket].count);
+    RedisModule_ReplyWithLongLong(ctx, counter->error);
+  }
+  return REDISMODULE_OK;
+}
+
+/* rater_info adds the statistics to INFO, as the rater_stats section. */
+static void rater_info(RedisModuleInfoCtx *ctx, int for_crash_report) {
+  REDISMODULE_NOT_USED(for_crash_report);
+  long long values[sizeof(rater_stats_names) / sizeof(rater_stats_names[0])];
+  rater_stats_values(values);
+
+  RedisModule_InfoAddSection(ctx, "stats");
+  for (int i = 0; rater_stats_names[i] != NULL; i++) {
+    RedisModule_InfoAddFieldLongLong(ctx, rater_stats_names[i], values[i]);
+  }
+}
+
+/* rater_configure applies the <name> <value> pairs given on module load. */
+static int rater_configure(RedisModuleCtx *ctx, RedisModuleString **argv,
+                           int argc) {
+  if (argc % 2 != 0) {
+    RedisModule_Log(ctx, "warning", "Module arguments must be name/value pairs");
+    return REDISMODULE_ERR;
+  }
+
+  for (int i = 0; i < argc; i += 2) {
+    const char *name = RedisModule_StringPtrLen(argv[i], NULL);
+    const char *value = RedisModule_StringPtrLen(argv[i + 1], NULL);
+    if (rater_arg_is(argv[i], "storage")) {
+      if (rater_arg_is(argv[i + 1], "string")) {
+        rater_storage = RATER_STORAGE_STRING;
+      } else if (rater_arg_is(argv[i + 1], "native")) {
+        rater_storage = RATER_STORAGE_NATIVE;
+      } else {
+        RedisModule_Log(ctx, "warning", "Invalid storage '%s'", value);
+        return REDISMODULE_ERR;
+      }
+    } else if (rater_arg_is(argv[i], "clock")) {
+      if (rater_arg_is(argv[i + 1], "precise")) {
+        rater_clock = RATE_LIMITER_CLOCK;
+      } else if (rater_arg_is(argv[i + 1], "coarse")) {
+#ifdef RATE_LIMITER_COARSE_CLOCK
+        struct timespec res;
+        if (clock_getres(RATE_LIMITER_COARSE_CLOCK, &res) != 0) {
+          RedisModule_Log(ctx, "warning", "Coarse clock is not available");
+          return REDISMODULE_ERR;
+        }
+        RedisModule_Log(ctx, "notice", "Using coarse clock, precise to %lld ns",
+                        (long long) res.tv_sec * NSEC_PER_SEC + res.tv_nsec);
+        rater_clock = RATE_LIMITER_COARSE_CLOCK;
+#else /*!RATE_LIMITER_COARSE_CLOCK*/
+        RedisModule_Log(ctx, "warning", "Coarse clock is not available");
+        return REDISMODULE_ERR;
+#endif /*RATE_LIMITER_COARSE_CLOCK*/
+      } else {
+        RedisModule_Log(ctx, "warning", "Invalid clock '%s'", value);
+        return REDISMODULE_ERR;
+      }
+    } else if (rater_arg_is(argv[i], "replication")) {
+      if (rater_arg_is(argv[i + 1], "commands")) {
+        rater_replication = RATER_REPLICATION_COMMANDS;
+      } else if (rater_arg_is(argv[i + 1], "compact")) {
+        rater_replication = RATER_REPLICATION_COMPACT;
+      } else {
+        RedisModule_Log(ctx, "warning", "Invalid replication '%s'", value);
+        return REDISMODULE_ERR;
+      }
+    } else if (rater_arg_is(argv[i], "expire-slack")) {
+      if (RedisModule_StringToLongLong(argv[i + 1], &rater_expire_slack) !=
+              REDISMODULE_OK ||
+          rater_expire_slack < 0) {
+        RedisModule_Log(ctx, "warning", "Invalid expire slack '%s'", value);
+        return REDISMODULE_ERR;
+      }
+    } else if (rater_arg_is(argv[i], "topk")) {
+      long long k;
+      if (RedisModule_StringToLongLong(argv[i + 1], &k) != REDISMODULE_OK ||
+          k < 0 || k > RATER_TOPK_MAX) {
+        RedisModule_Log(ctx, "warning", "Invalid topk '%s'", value);
+        return REDISMODULE_ERR;
+      }
+      rater_topk_free();
+      if (k > 0) rater_topk_init(k);
+    } else if (rater_arg_is(argv[i], "allow-now")) {
+      if (rater_arg_is(argv[i + 1], "yes")) {
+        rater_allow_now = 1;
+      } else if (rater_arg_is(argv[i + 1], "no")) {
+        rater_allow_now = 0;
+      } else {
+        RedisModule_Log(ctx, "warning", "Invalid allow-now '%s'", value);
+        return REDISMODULE_ERR;
+      }
+    } else if (rater_arg_is(argv[i], "scale-decrease")) {
+      if (RedisModule_StringToDouble(argv[i + 1], &rater_scale_decrease) !=
+              REDISMODULE_OK ||
+          !(rater_scale_decrease > 1)) {
+        RedisModule_Log(ctx, "warning", "Invalid scale decrease '%s'", value);
+        return REDISMODULE_ERR;
+      }
+    } else if (rater_arg_is(argv[i], "scale-increase")) {
+      if (RedisModule_StringToDouble(argv[i + 1], &rater_scale_increase) !=
+              REDISMODULE_OK ||
+          !(rater_scale_increase > 0 && rater_scale_increase <= 1)) {
+        RedisModule_Log(ctx, "warning", "Invalid scale increase '%s'", value);
+        return REDISMODULE_ERR;
+      }
+    } else if (rater_arg_is(argv[i], "scale-min")) {
+      if (RedisModule_StringToDouble(argv[i + 1], &rater_scale_min) !=
+              REDISMODULE_OK ||
+          !(rater_scale_min > 0 && rater_scale_min <= 1)) {
+        RedisModule_Log(ctx, "warning", "Invalid scale min '%s'", value);
+        return REDISMODULE_ERR;
+      }
+    } else if (rater_arg_is(argv[i], "events")) {
+      if (rater_events.stream) {
+        RedisModule_FreeString(NULL, rater_events.stream);
+      }
+      rater_events.stream =
+          RedisModule_CreateStringFromString(NULL, argv[i + 1]);
+    } else if (rater_arg_is(argv[i], "events-sample")) {
+      if (RedisModule_StringToLongLong(argv[i + 1], &rater_events.sample) !=
+              REDISMODULE_OK ||
+          rater_events.sample <= 0) {
+        RedisModule_Log(ctx, "warning", "Invalid events sample '%s'", value);
+        return REDISMODULE_ERR;
+      }
+    } else if (rater_arg_is(argv[i], "events-maxlen")) {
+      if (RedisModule_StringToLongLong(argv[i + 1], &rater_events.maxlen) !=
+              REDISMODULE_OK ||
+          rater_events.maxlen <= 0) {
+        RedisModule_Log(ctx, "warning", "Invalid events maxlen '%s'", value);
+        return REDISMODULE_ERR;
+      }
+    } else if (rater_arg_is(argv[i], "events-flush")) {
+      if (RedisModule_StringToLongLong(argv[i + 1], &rater_events.flush) !=
+              REDISMODULE_OK ||
+          rater_events.flush < 0) {
+        RedisModule_Log(ctx, "warning", "Invalid events flush '%s'", value);
+        return REDISMODULE_ERR;
+      }
+    } else if (rater_arg_is(argv[i], "coalesce")) {
+      if (RedisModule_StringToLongLong(argv[i + 1], &rater_coalesce) !=
+              REDISMODULE_OK ||
+          rater_coalesce < 0) {
+        RedisModule_Log(ctx, "warning", "Invalid coalesce '%s'", value);
+        return REDISMODULE_ERR;
+      }
+    } else {
+      RedisModule_Log(ctx, "warning", "Unknown module argument '%s'", name);
+      return REDISMODULE_ERR;
+    }
+  }
 
-  RedisModule_ReplyWithArray(ctx, 5);
-  /* Limited is 0 if not limited, 1 if limited. */
-  RedisModule_ReplyWithLongLong(ctx, limited);
-  /* Limit is burst + 1 */
-  RedisModule_ReplyWithLongLong(ctx, limit);
-  /* Remaining count ranges from zero to limit withing a period. */
-  RedisModule_ReplyWithLongLong(ctx, remaining);
-  /* Retry after this many of seconds to get through or -1 if not limited. */
-  RedisModule_ReplyWithLongLong(ctx, retry_after);
-  /* Amount of seconds to wait until both the burst and the rate restarts. */
-  RedisModule_ReplyWithLongLong(ctx, ttl / MSEC_PER_SEC);
+  if (rater_coalesce > 0 && rater_replication != RATER_REPLICATION_COMPACT) {
+    RedisModule_Log(ctx, "warning", "Coalescing requires compact replication");
+    return REDISMODULE_ERR;
+  }
 
   return REDISMODULE_OK;
 }
 
+/* Every command the module exports. Redis before 7.0 only sees the legacy
+ * first/last/step triple; newer servers also get the arity and a key spec, so
+ * cluster-aware clients can route without a MOVED round trip. */
+typedef struct rater_command {
+  const char *name;
+  RedisModuleCmdFunc func;
+  const char *flags;
+  int firstkey, lastkey, keystep;
+  int arity;
+  uint64_t key_flags;
+  const char *summary;
+} rater_command;
+
+#define RATER_KEY_UPDATE                                                       \
+  (REDISMODULE_CMD_KEY_RW | REDISMODULE_CMD_KEY_ACCESS |                       \
+   REDISMODULE_CMD_KEY_UPDATE)
+#define RATER_KEY_READ (REDISMODULE_CMD_KEY_RO | REDISMODULE_CMD_KEY_ACCESS)
+#define RATER_KEY_OVERWRITE                                                    \
+  (REDISMODULE_CMD_KEY_OW | REDISMODULE_CMD_KEY_UPDATE)
+
+static const rater_command rater_commands[] = {
+    {"rater.limit", RaterLimit_RedisCommand, "write deny-oom fast", 1, 1, 1, -5,
+     RATER_KEY_UPDATE, "Rate limit a key with GCRA"},
+    {"rater.slimit", RaterSLimit_RedisCommand, "write deny-oom fast", 1, 1, 1,
+     -6, RATER_KEY_UPDATE, "Rate limit a key holding a stripe of a limit"},
+    {"rater.peek", RaterPeek_RedisCommand, "readonly fast", 1, 1, 1, -5,
+     RATER_KEY_READ, "Inspect a rate limit without consuming it"},
+    /* Leading options shift the keys, so the spec is incomplete and the
+     * getkeys-api callback has the final word. */
+    {"rater.mlimit", RaterMLimit_RedisCommand, "write deny-oom getkeys-api", 1,
+     -1, 5, -6, RATER_KEY_UPDATE | REDISMODULE_CMD_KEY_INCOMPLETE,
+     "Rate limit several keys at once"},
+    {"rater.hlimit", RaterHLimit_RedisCommand, "write deny-oom getkeys-api", 2,
+     -1, 4, -6, RATER_KEY_UPDATE | REDISMODULE_CMD_KEY_INCOMPLETE,
+     "Rate limit a chain of nested limits, all or nothing"},
+    {"rater.lease", RaterLease_RedisCommand, "write deny-oom fast", 1, 1, 1,
+     -6, RATER_KEY_UPDATE, "Lease several units of a rate limit at once"},
+    {"rater.return", RaterReturn_RedisCommand, "write deny-oom fast", 1, 1, 1,
+     -6, RATER_KEY_UPDATE, "Return the unused units of a lease"},
+    {"rater.acquire", RaterAcquire_RedisCommand, "write deny-oom fast", 1, 1,
+     1, -4, RATER_KEY_UPDATE, "Acquire units of a semaphore for a lease"},
+    {"rater.release", RaterRelease_RedisCommand, "write deny-oom fast", 1, 1,
+     1, -3, RATER_KEY_UPDATE, "Release the units of a semaphore lease"},
+    {"rater.semset", RaterSemSet_RedisCommand, "write deny-oom fast", 1, 1, 1,
+     -4, RATER_KEY_OVERWRITE, "Set the holders of a semaphore"},
+    {"rater.semsync", RaterSemSync_RedisCommand, "write deny-oom fast", 1, 1,
+     1, 8, RATER_KEY_UPDATE, "Apply a replicated update of a semaphore"},
+    {"rater.wait", RaterWait_RedisCommand, "write deny-oom", 1, 1, 1, -7,
+     RATER_KEY_UPDATE, "Rate limit a key, waiting until allowed"},
+    {"rater.set", RaterSet_RedisCommand, "write deny-oom fast", 1, 1, 1, -3,
+     RATER_KEY_OVERWRITE, "Store the theoretical arrival time of a key"},
+    {"rater.wset", RaterWSet_RedisCommand, "write deny-oom fast", 1, 1, 1, -5,
+     RATER_KEY_OVERWRITE, "Set the window of a key"},
+    {"rater.policy", RaterPolicy_RedisCommand, "", 0, 0, 0, -2, 0,
+     "Manage named limit policies"},
+    {"rater.apply", RaterApply_RedisCommand, "write deny-oom fast", 2, 2, 1, -3,
+     RATER_KEY_UPDATE, "Rate limit a key with a named policy"},
+    {"rater.scale", RaterScale_RedisCommand, "fast", 0, 0, 0, -2, 0,
+     "Scale limits at runtime"},
+    {"rater.reset", RaterReset_RedisCommand, "write admin", 0, 0, 0, 2, 0,
+     "Delete the limits of keys matching a pattern in the background"},
+    {"rater.stats", RaterStats_RedisCommand, "readonly fast", 0, 0, 0, -1, 0,
+     "Report runtime statistics"},
+    {"rater.toplimited", RaterTopLimited_RedisCommand, "readonly", 0, 0, 0, 2,
+     0, "List the keys limited the most"},
+    {"rater.tlimit", RaterTLimit_RedisCommand, "write deny-oom fast", 1, 1, 1,
+     -6, RATER_KEY_UPDATE, "Rate limit a member of a table"},
+    {"rater.table", RaterTable_RedisCommand, "write deny-oom", 2, 2, 1, -3,
+     RATER_KEY_UPDATE, "Create, inspect and replicate limit tables"},
+    {"rater.sketch", RaterSketch_RedisCommand, "write deny-oom", 2, 2, 1, -3,
+     RATER_KEY_UPDATE, "Create, inspect and rate limit with sketches"},
+    {"rater.sync", RaterSync_RedisCommand, "write deny-oom fast", 1, 1, 1, 3,
+     RATER_KEY_OVERWRITE, "Replicate the state of a key"},
+    {NULL}};
+
+/* Flags only Redis 7.0 and newer know, added to those of the command there,
+ * as older servers refuse the whole command otherwise. */
+static const struct {
+  const char *name;
+  const char *flags;
+} rater_flags_7[] = {{"rater.wait", "blocking"}, {NULL, NULL}};
+
+static int rater_create_command(RedisModuleCtx *ctx,
+                                const rater_command *command) {
+  const char *flags = command->flags;
+  char buf[128];
+  for (int i = 0; rater_flags_7[i].name && RedisModule_SetCommandInfo; i++) {
+    if (strcmp(rater_flags_7[i].name, command->name) == 0) {
+      snprintf(buf, sizeof(buf), "%s %s", flags, rater_flags_7[i].flags);
+      flags = buf;
+    }
+  }
+  if (RedisModule_CreateCommand(ctx, command->name, command->func, flags,
+                                command->firstkey,
+                                command->lastkey,
+                                command->keystep) == REDISMODULE_ERR) {
+    return REDISMODULE_ERR;
+  }
+
+  /* Command info is only understood by Redis 7.0 and newer */
+  if (RedisModule_SetCommandInfo == NULL || RedisModule_GetCommand == NULL) {
+    return REDISMODULE_OK;
+  }
+
+  RedisModuleCommandKeySpec key_specs[] = {
+      {.flags = command->key_flags,
+       .begin_search_type = REDISMODULE_KSPEC_BS_INDEX,
+       .bs.index.pos = command->firstkey,
+       .find_keys_type = REDISMODULE_KSPEC_FK_RANGE,
+       .fk.range = {.lastkey = command->lastkey < 0
+                                   ? command->lastkey
+                                   : command->lastkey - command->firstkey,
+                    .keystep = command->keystep,
+                    .limit = 0}},
+      {0}};
+  RedisModuleCommandInfo info = {
+      .version = REDISMODULE_COMMAND_INFO_VERSION_PTR,
+      .summary = command->summary,
+      .arity = command->arity,
+      .key_specs = command->firstkey > 0 ? key_specs : NULL,
+  };
+  return RedisModule_SetCommandInfo(RedisModule_GetCommand(ctx, command->name),
+                                    &info);
+}
+
 int RedisModule_OnLoad(RedisModuleCtx *ctx, RedisModuleString **argv,
                        int argc) {
-  REDISMODULE_NOT_USED(argv);
-  REDISMODULE_NOT_USED(argc);
   if (RedisModule_Init(ctx, "rater", 1, REDISMODULE_APIVER_1) ==
       REDISMODULE_ERR) {
     return REDISMODULE_ERR;
   }
 
-  if (RedisModule_CreateCommand(ctx, "rater.limit", RaterLimit_RedisCommand,
-                                "write deny-oom random", 1, 1,
-                                1) == REDISMODULE_ERR) {
+  if (rater_configure(ctx, argv, argc) == REDISMODULE_ERR) {
+    return REDISMODULE_ERR;
+  }
+
+  if (RedisModule_CreateDict == NULL) {
+    RedisModule_Log(ctx, "warning", "Redis 5.0 or newer is required");
+    return REDISMODULE_ERR;
+  }
+  rater_policies = RedisModule_CreateDict(NULL);
+  rater_pending = RedisModule_CreateDict(NULL);
+  rater_queues = RedisModule_CreateDict(NULL);
+  rater_waiters = RedisModule_CreateDict(NULL);
+
+  RedisModuleTypeMethods tm = {.version = REDISMODULE_TYPE_METHOD_VERSION,
+                               .rdb_load = rater_type_rdb_load,
+                               .rdb_save = rater_type_rdb_save,
+                               .aof_rewrite = rater_type_aof_rewrite,
+                               .mem_usage = rater_type_mem_usage,
+                               .digest = rater_type_digest,
+                               .free = rater_type_free,
+                               .aux_load = rater_type_aux_load,
+                               .aux_save = rater_type_aux_save,
+                               .aux_save_triggers = REDISMODULE_AUX_BEFORE_RDB};
+  RaterType = RedisModule_CreateDataType(ctx, "rater-tat", RATER_TYPE_ENCVER,
+                                         &tm);
+  if (RaterType == NULL) {
+    return REDISMODULE_ERR;
+  }
+
+  RedisModuleTypeMethods table_tm = {.version = REDISMODULE_TYPE_METHOD_VERSION,
+                                     .rdb_load = rater_table_rdb_load,
+                                     .rdb_save = rater_table_rdb_save,
+                                     .aof_rewrite = rater_table_aof_rewrite,
+                                     .mem_usage = rater_table_mem_usage,
+                                     .digest = rater_table_digest,
+                                     .free = rater_table_free};
+  RaterTableType = RedisModule_CreateDataType(ctx, "rater-tbl",
+                                              RATER_TABLE_ENCVER, &table_tm);
+  if (RaterTableType == NULL) {
+    return REDISMODULE_ERR;
+  }
+
+  RedisModuleTypeMethods sketch_tm = {.version = REDISMODULE_TYPE_METHOD_VERSION,
+                                      .rdb_load = rater_sketch_rdb_load,
+                                      .rdb_save = rater_sketch_rdb_save,
+                                      .aof_rewrite = rater_sketch_aof_rewrite,
+                                      .mem_usage = rater_sketch_mem_usage,
+                                      .digest = rater_sketch_digest,
+                                      .free = rater_sketch_free};
+  RaterSketchType = RedisModule_CreateDataType(ctx, "rater-skt",
+                                               RATER_SKETCH_ENCVER, &sketch_tm);
+  if (RaterSketchType == NULL) {
+    return REDISMODULE_ERR;
+  }
+
+  RedisModuleTypeMethods window_tm = {.version = REDISMODULE_TYPE_METHOD_VERSION,
+                                      .rdb_load = rater_window_rdb_load,
+                                      .rdb_save = rater_window_rdb_save,
+                                      .aof_rewrite = rater_window_aof_rewrite,
+                                      .mem_usage = rater_window_mem_usage,
+                                      .digest = rater_window_digest,
+                                      .free = rater_window_free};
+  RaterWindowType = RedisModule_CreateDataType(ctx, "rater-win",
+                                               RATER_WINDOW_ENCVER, &window_tm);
+  if (RaterWindowType == NULL) {
     return REDISMODULE_ERR;
   }
 
+  RedisModuleTypeMethods sem_tm = {.version = REDISMODULE_TYPE_METHOD_VERSION,
+                                   .rdb_load = rater_sem_rdb_load,
+                                   .rdb_save = rater_sem_rdb_save,
+                                   .aof_rewrite = rater_sem_aof_rewrite,
+                                   .mem_usage = rater_sem_mem_usage,
+                                   .digest = rater_sem_digest,
+                                   .free = rater_sem_free};
+  RaterSemType = RedisModule_CreateDataType(ctx, "rater-sem", RATER_SEM_ENCVER,
+                                            &sem_tm);
+  if (RaterSemType == NULL) {
+    return REDISMODULE_ERR;
+  }
+
+  for (const rater_command *command = rater_commands; command->name != NULL;
+       command++) {
+    if (rater_create_command(ctx, command) == REDISMODULE_ERR) {
+      return REDISMODULE_ERR;
+    }
+  }
+
+  /* The INFO section is only available on Redis 6.0 and newer */
+  if (RedisModule_RegisterInfoFunc != NULL) {
+    RedisModule_RegisterInfoFunc(ctx, rater_info);
+  }
+
   return REDISMODULE_OK;
 }
@@ -0,0 +1,126 @@
+/*
+ * Copyright (c) 2018 OnSign TV Limited
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "rater.h"
+
+RATER_API long long rater_clock_nanos(clockid_t clock) {
+  struct timespec ts;
+  clock_gettime(clock, &ts);
+  return ((long long) ts.tv_sec) * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+RATER_API void rater_params_init(rater_params *params, long long burst,
+                                 long long count_per_period,
+                                 long long period_in_sec) {
+  params->burst = burst;
+  params->count_per_period = count_per_period;
+  params->period_in_sec = period_in_sec;
+  params->algo = 0;
+
+  __int128 period = (__int128) period_in_sec * NSEC_PER_SEC;
+  params->emission_interval = rater_saturate(period / count_per_period);
+  params->delay_variation_tolerance =
+      rater_saturate(period * (burst + 1) / count_per_period);
+
+  /* More than one event per nanosecond can't be represented, so such rates
+   * are capped to exactly that. */
+  if (params->emission_interval == 0) {
+    params->emission_interval = 1;
+    params->delay_variation_tolerance = burst + 1;
+  }
+}
+
+RATER_API long long rater_limit(const rater_params *params, long long tat,
+                                long long now, long long quantity,
+                                long long *limited, long long *limit,
+                                long long *remaining, long long *retry_after,
+                                long long *ttl) {
+  long long emission_interval = params->emission_interval;
+  long long delay_variation_tolerance = params->delay_variation_tolerance;
+
+  *limited = 0;
+  *retry_after = -1;
+  *limit = params->burst + 1;
+  *remaining = 0;
+
+  /* tat refers to the theoretical arrival time that would be expected
+   * from equally spaced requests at exactly the rate limit. */
+  if (tat == 0) {
+    tat = now;
+  }
+
+  /* Quantities in bytes times emission intervals in nanoseconds easily
+   * overflow a long long, so times are worked out in 128 bits and only those
+   * that are kept or returned are saturated. */
+  __int128 increment = (__int128) emission_interval * quantity;
+  __int128 new_tat;
+  if (now > tat) {
+    new_tat = now + increment;
+  } else {
+    new_tat = tat + increment;
+  }
+
+  /* Block the request if the next permitted time is in the future. */
+  __int128 allow_at = new_tat - delay_variation_tolerance;
+  __int128 diff = now - allow_at;
+  if (diff < 0) {
+    new_tat = 0;
+    *limited = 1;
+    *ttl = tat - now;
+    if (increment <= delay_variation_tolerance) {
+      *retry_after = rater_saturate(-diff);
+    }
+  } else {
+    *ttl = rater_saturate(new_tat - now);
+  }
+
+  long long next = delay_variation_tolerance - *ttl;
+  if (next > -emission_interval) {
+    *remaining = next / emission_interval;
+  }
+
+  /* Peeking never updates the key. */
+  if (quantity == 0) {
+    return 0;
+  }
+  return rater_saturate(new_tat);
+}
+
+RATER_API long long rater_limit_atomic(const rater_params *params,
+                                       rater_atomic_tat *tat, long long now,
+                                       long long quantity, long long *limited,
+                                       long long *limit, long long *remaining,
+                                       long long *retry_after, long long *ttl) {
+  int64_t old = atomic_load_explicit(tat, memory_order_acquire);
+  for (;;) {
+    long long new_tat = rater_limit(params, old, now, quantity, limited, limit,
+                                    remaining, retry_after, ttl);
+    if (new_tat == 0) return 0;
+
+    /* On failure old is reloaded with the current value */
+    if (atomic_compare_exchange_weak_explicit(tat, &old, new_tat,
+                                              memory_order_acq_rel,
+                                              memory_order_acquire)) {
+      return new_tat;
+    }
+  }
+}
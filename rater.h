@@ -0,0 +1,168 @@
+/*
+ * Copyright (c) 2018 OnSign TV Limited
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * The GCRA core of the module, with no dependency on Redis, so that the very
+ * same algorithm can be embedded in other programs. Build it with
+ * `make librater.a`.
+ *
+ * Everything here is thread-safe: rater_limit is a pure function of its
+ * arguments, and rater_limit_atomic updates a theoretical arrival time shared
+ * by many threads with compare-and-swap.
+ */
+
+#ifndef RATER_H
+#define RATER_H
+
+#include <limits.h>
+#include <stdint.h>
+#include <time.h>
+
+/* Functions are extern, unless RATER_API is defined otherwise, as the module
+ * does to compile them as static along with its own code. */
+#ifndef RATER_API
+#define RATER_API
+#endif
+
+/* The atomic theoretical arrival times of rater_limit_atomic. C++ can't spell
+ * _Atomic before C++23, but std::atomic<int64_t> has the same representation
+ * with GCC and Clang. */
+#ifdef __cplusplus
+#include <atomic>
+typedef std::atomic<int64_t> rater_atomic_tat;
+extern "C" {
+#else
+#include <stdatomic.h>
+typedef _Atomic int64_t rater_atomic_tat;
+#endif
+
+/* Users can decide what's more important to them:
+ *  1. the ability to maintain existing limits when a failover process is
+ *     initiated by Redis Sentinel.
+ *  2. incorrect rate-limits due to changes in the system time-of-day clock.
+ *
+ * By default, we prefer to use the realtime clock (1) rather than the monotonic
+ * clock (2).
+ */
+#ifdef USE_MONOTONIC_CLOCK
+#define RATE_LIMITER_CLOCK CLOCK_MONOTONIC
+#ifdef CLOCK_MONOTONIC_COARSE
+#define RATE_LIMITER_COARSE_CLOCK CLOCK_MONOTONIC_COARSE
+#endif
+#else /*!USE_MONOTONIC_CLOCK*/
+#define RATE_LIMITER_CLOCK CLOCK_REALTIME
+#ifdef CLOCK_REALTIME_COARSE
+#define RATE_LIMITER_COARSE_CLOCK CLOCK_REALTIME_COARSE
+#endif
+#endif /*USE_MONOTONIC_CLOCK*/
+
+/* nanoseconds per second */
+#define NSEC_PER_SEC 1000000000LL
+
+/* microseconds per second */
+#define USEC_PER_SEC 1000000LL
+
+/* miliseconds per second */
+#define MSEC_PER_SEC 1000LL
+
+/* nanoseconds per milisecond and per microsecond */
+#define NSEC_PER_MSEC 1000000LL
+#define NSEC_PER_USEC 1000LL
+
+/* rater_params describes a limit: the parameters given by the user along with
+ * the intervals derived from them, in nanoseconds. */
+typedef struct rater_params {
+  long long burst;
+  long long count_per_period;
+  long long period_in_sec;
+  /* Algorithm the limit is enforced with by the module, 0 being GCRA, the
+   * only one implemented here */
+  int algo;
+
+  /* emission_interval is the time between events in the nominal equally
+   * spaced events. If you like leaky buckets, think of it as how frequently
+   * the bucket leaks one unit. */
+  long long emission_interval;
+
+  /* delay_variation_tolerance is our flexibility:
+   * How far can you deviate from the nominal equally spaced schedule?
+   * If you like leaky buckets, think about it as the size of your bucket. */
+  long long delay_variation_tolerance;
+} rater_params;
+
+/* rater_saturate clamps v to the range of a long long. */
+static inline long long rater_saturate(__int128 v) {
+  if (v > LLONG_MAX) return LLONG_MAX;
+  if (v < LLONG_MIN) return LLONG_MIN;
+  return (long long) v;
+}
+
+/* rater_clock_nanos returns the time of clock in nanoseconds. */
+RATER_API long long rater_clock_nanos(clockid_t clock);
+
+/* rater_params_init derives the intervals of a limit with exact integer
+ * arithmetic. The period is converted to nanoseconds on 128 bits, so long
+ * periods neither overflow nor lose precision as they did through a double,
+ * and the tolerance is computed from the period itself rather than from the
+ * already rounded emission interval. */
+RATER_API void rater_params_init(rater_params *params, long long burst,
+                                 long long count_per_period,
+                                 long long period_in_sec);
+
+/* rater_limit checks whether a particular key has exceeded a rate limit.
+ * burst defines the maximum amount permitted in a single instant while
+ * count_per_period / period_in_sec defines the maximum sustained rate.
+ *
+ * If the rate limit has not been exceeded, the underlying storage
+ * is updated by the supplied quantity. For example, a quantity of
+ * 1 might be used to rate limit a single request while a greater
+ * quantity could rate limit based on the size of a file upload in
+ * bytes, however large, as times saturate rather than overflow. If
+ * quantity is 0, no update is performed allowing you to "peek" at the
+ * state of the rate limiter for a given key.
+ *
+ * The current time is given by the caller as now, so that several keys can be
+ * evaluated against the very same clock reading, and the limit is given as
+ * rater_params, computed once by rater_params_init. Both retry_after and ttl
+ * are in nanoseconds, the unit of replies being up to the caller. */
+RATER_API long long rater_limit(const rater_params *params, long long tat,
+                                long long now, long long quantity,
+                                long long *limited, long long *limit,
+                                long long *remaining, long long *retry_after,
+                                long long *ttl);
+
+/* rater_limit_atomic is rater_limit on a theoretical arrival time shared by
+ * several threads, which it updates with compare-and-swap and without locks:
+ * when another thread updated tat in the meantime, the limit is evaluated
+ * again against the new value. Returns the new theoretical arrival time, or 0
+ * if tat was left untouched. */
+RATER_API long long rater_limit_atomic(const rater_params *params,
+                                       rater_atomic_tat *tat, long long now,
+                                       long long quantity, long long *limited,
+                                       long long *limit, long long *remaining,
+                                       long long *retry_after, long long *ttl);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* RATER_H */